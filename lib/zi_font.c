@@ -5,8 +5,258 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+// Build with -DZI_NO_SIMD to force the scalar pixel kernels
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(ZI_NO_SIMD)
+#define ZI_X86 1
+#include <immintrin.h>
+#endif
 #include "zi_font.h"
 
+// == CODEPOINT LOOKUP ==
+
+#define ZI_DIRECT 256 // codepoints below this are looked up directly
+
+// Lookup index: direct table for Latin-1, sorted SoA arrays for the rest
+struct zi_index {
+	int32_t direct[ZI_DIRECT];  // glyph index or -1
+	uint8_t direct_w[ZI_DIRECT];
+	uint32_t count;             // number of sparse entries
+	uint16_t *codes;            // sorted codepoints >= ZI_DIRECT
+	uint8_t *widths;            // width per sparse entry
+	uint32_t *slots;            // glyph index per sparse entry
+};
+
+static void zi_free_index(zi_index_t *ix) {
+	if(!ix) return;
+	free(ix->codes);
+	free(ix->widths);
+	free(ix->slots);
+	free(ix);
+}
+
+// Sort key: codepoint, then glyph index so first duplicate wins
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Build codepoint index, must be rebuilt if glyphs are changed
+int zi_build_index(zi_font_t *font) {
+	zi_index_t *ix = calloc(1, sizeof(zi_index_t));
+	if(!ix) return -1;
+	for(uint32_t i = 0; i < ZI_DIRECT; i++) ix->direct[i] = -1;
+
+	// sparse keys are (code << 32 | glyph index)
+	uint32_t sparse = 0;
+	for(uint32_t i = 0; i < font->glyph_count; i++) {
+		if(font->glyphs[i].c >= ZI_DIRECT) sparse++;
+	}
+	uint64_t *keys = malloc((sparse ? sparse : 1) * sizeof(uint64_t));
+	ix->codes = malloc((sparse ? sparse : 1) * sizeof(uint16_t));
+	ix->widths = malloc(sparse ? sparse : 1);
+	ix->slots = malloc((sparse ? sparse : 1) * sizeof(uint32_t));
+	if(!keys || !ix->codes || !ix->widths || !ix->slots) {
+		free(keys);
+		zi_free_index(ix);
+		return -1;
+	}
+
+	uint32_t k = 0;
+	for(uint32_t i = 0; i < font->glyph_count; i++) {
+		const zi_glyph_t *g = &font->glyphs[i];
+		if(g->c < ZI_DIRECT) {
+			if(ix->direct[g->c] < 0) {
+				ix->direct[g->c] = (int32_t)i;
+				ix->direct_w[g->c] = g->w;
+			}
+		} else {
+			keys[k++] = ((uint64_t)g->c << 32) | i;
+		}
+	}
+	qsort(keys, sparse, sizeof(uint64_t), cmp_u64);
+
+	for(uint32_t i = 0; i < sparse; i++) {
+		uint16_t c = (uint16_t)(keys[i] >> 32);
+		uint32_t gi = (uint32_t)keys[i];
+		if(ix->count && ix->codes[ix->count - 1] == c) continue; // duplicate
+		ix->codes[ix->count] = c;
+		ix->widths[ix->count] = font->glyphs[gi].w;
+		ix->slots[ix->count] = gi;
+		ix->count++;
+	}
+	free(keys);
+
+	zi_free_index(font->index);
+	font->index = ix;
+	return 0;
+}
+
+// Position of cp in sparse arrays or -1
+static int32_t sparse_find(const zi_index_t *ix, uint32_t cp) {
+	uint32_t lo = 0, hi = ix->count;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) >> 1;
+		if(ix->codes[mid] < cp) lo = mid + 1;
+		else hi = mid;
+	}
+	return (lo < ix->count && ix->codes[lo] == cp) ? (int32_t)lo : -1;
+}
+
+// Glyph index for codepoint or -1
+int32_t zi_find_index(const zi_font_t *font, uint32_t cp) {
+	const zi_index_t *ix = font->index;
+	if(!ix) { // no index, walk the list
+		for(uint32_t i = 0; i < font->glyph_count; i++) {
+			if(font->glyphs[i].c == cp) return (int32_t)i;
+		}
+		return -1;
+	}
+	if(cp < ZI_DIRECT) return ix->direct[cp];
+	int32_t s = sparse_find(ix, cp);
+	return s < 0 ? -1 : (int32_t)ix->slots[s];
+}
+
+// Glyph for codepoint or NULL
+const zi_glyph_t * zi_find_glyph(const zi_font_t *font, uint32_t cp) {
+	int32_t i = zi_find_index(font, cp);
+	return i < 0 ? NULL : &font->glyphs[i];
+}
+
+// Width of glyph for codepoint or -1
+int zi_glyph_width(const zi_font_t *font, uint32_t cp) {
+	const zi_index_t *ix = font->index;
+	if(!ix) {
+		const zi_glyph_t *g = zi_find_glyph(font, cp);
+		return g ? g->w : -1;
+	}
+	if(cp < ZI_DIRECT) return ix->direct[cp] < 0 ? -1 : ix->direct_w[cp];
+	int32_t s = sparse_find(ix, cp);
+	return s < 0 ? -1 : ix->widths[s];
+}
+
+// == WORKER POOL ==
+
+#define ZI_CHUNK 16 // items taken per grab from own range
+
+// Per-worker range of items, thieves take the upper half
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t next, end;
+} zi_range_t;
+
+typedef struct {
+	zi_range_t *ranges;
+	unsigned workers;
+	void (*fn)(void *ctx, uint32_t item, unsigned worker);
+	void *ctx;
+} zi_pool_t;
+
+typedef struct {
+	zi_pool_t *pool;
+	unsigned id;
+} zi_worker_t;
+
+// Grab up to ZI_CHUNK items from own range
+static int pool_take(zi_range_t *r, uint32_t *lo, uint32_t *hi) {
+	pthread_mutex_lock(&r->lock);
+	int ok = r->next < r->end;
+	if(ok) {
+		*lo = r->next;
+		*hi = r->end - r->next > ZI_CHUNK ? r->next + ZI_CHUNK : r->end;
+		r->next = *hi;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return ok;
+}
+
+// Move upper half of some other worker's range into own range
+static int pool_steal(zi_pool_t *p, unsigned self) {
+	for(unsigned k = 1; k < p->workers; k++) {
+		zi_range_t *v = &p->ranges[(self + k) % p->workers];
+		uint32_t lo = 0, hi = 0;
+		pthread_mutex_lock(&v->lock);
+		if(v->next < v->end) {
+			uint32_t half = (v->end - v->next + 1) / 2;
+			hi = v->end;
+			lo = v->end - half;
+			v->end = lo;
+		}
+		pthread_mutex_unlock(&v->lock);
+		if(lo < hi) {
+			zi_range_t *r = &p->ranges[self];
+			pthread_mutex_lock(&r->lock);
+			r->next = lo;
+			r->end = hi;
+			pthread_mutex_unlock(&r->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void * pool_worker(void *arg) {
+	zi_worker_t *w = (zi_worker_t *)arg;
+	zi_pool_t *p = w->pool;
+	uint32_t lo, hi;
+	do {
+		while(pool_take(&p->ranges[w->id], &lo, &hi)) {
+			for(uint32_t i = lo; i < hi; i++) p->fn(p->ctx, i, w->id);
+		}
+	} while(pool_steal(p, w->id));
+	return NULL;
+}
+
+// Run fn over items 0..count-1 on up to 'threads' workers (caller included)
+static void run_parallel(uint32_t count, unsigned threads, void (*fn)(void *, uint32_t, unsigned), void *ctx) {
+	if(threads > count / ZI_CHUNK) threads = count / ZI_CHUNK;
+	if(threads <= 1) {
+		for(uint32_t i = 0; i < count; i++) fn(ctx, i, 0);
+		return;
+	}
+
+	zi_range_t *ranges = malloc(threads * sizeof(zi_range_t));
+	zi_worker_t *workers = malloc(threads * sizeof(zi_worker_t));
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	if(!ranges || !workers || !tids) {
+		free(ranges);
+		free(workers);
+		free(tids);
+		for(uint32_t i = 0; i < count; i++) fn(ctx, i, 0);
+		return;
+	}
+
+	zi_pool_t pool = { ranges, threads, fn, ctx };
+	for(unsigned t = 0; t < threads; t++) {
+		pthread_mutex_init(&ranges[t].lock, NULL);
+		ranges[t].next = (uint32_t)((uint64_t)count * t / threads);
+		ranges[t].end = (uint32_t)((uint64_t)count * (t + 1) / threads);
+		workers[t].pool = &pool;
+		workers[t].id = t;
+	}
+
+	// worker 0 runs on the calling thread, ranges of workers that failed to start get stolen
+	unsigned started = 1;
+	for(unsigned t = 1; t < threads; t++, started++) {
+		if(pthread_create(&tids[t], NULL, pool_worker, &workers[t])) break;
+	}
+	pool_worker(&workers[0]);
+	for(unsigned t = 1; t < started; t++) pthread_join(tids[t], NULL);
+
+	for(unsigned t = 0; t < threads; t++) pthread_mutex_destroy(&ranges[t].lock);
+	free(ranges);
+	free(workers);
+	free(tids);
+}
+
 // == ZI FONT LOADING/DECODING ==
 
 // De-quantize 3-bit to 8-bit
@@ -14,314 +264,918 @@ static inline uint8_t a3_to_a8(uint8_t v3) {
 	return (uint8_t)((v3 * 255 + 3) / 7);
 }
 
+// Quantize 8-bit to 3-bit
+static inline uint8_t q3(uint8_t v8) {
+	return (uint8_t)((v8 * 7 + 127) / 255);
+}
+
+// Decoder opcode: zeros, then count pixels (first, then rest)
+typedef struct {
+	uint8_t zeros;
+	uint8_t count;
+	uint8_t first;
+	uint8_t rest;
+} zi_op_t;
+
+#define A3(v) ((uint8_t)(((v) * 255 + 3) / 7))
+
+// Anti-aliased (0x03) opcodes
+// 00 b xxxxx: run of trans/opaque, 01 b xxxxx: trans run then 1/2 opaque
+// 10 xxx ccc: trans run then alpha, 11 ccc ddd: two alphas
+#define AA_Z(b) ((b) < 0x40 ? (((b) & 0x20) ? 0 : (b) & 31) : (b) < 0x80 ? (b) & 31 : (b) < 0xC0 ? ((b) >> 3) & 7 : 0)
+#define AA_N(b) ((b) < 0x40 ? (((b) & 0x20) ? (b) & 31 : 0) : (b) < 0x80 ? (((b) & 0x20) ? 2 : 1) : (b) < 0xC0 ? 1 : 2)
+#define AA_F(b) ((b) < 0x80 ? 255 : (b) < 0xC0 ? A3((b) & 7) : A3(((b) >> 3) & 7))
+#define AA_R(b) ((b) < 0x80 ? 255 : A3((b) & 7))
+
+// Mono (0x01) opcodes, 00 and 01 as above
+// 10 b xxxxx: trans run then 3/4 opaque, 11 www bbb: trans run then opaque run
+#define BW_Z(b) ((b) < 0x40 ? (((b) & 0x20) ? 0 : (b) & 31) : (b) < 0xC0 ? (b) & 31 : ((b) >> 3) & 7)
+#define BW_N(b) ((b) < 0x40 ? (((b) & 0x20) ? (b) & 31 : 0) : (b) < 0x80 ? (((b) & 0x20) ? 2 : 1) : (b) < 0xC0 ? (((b) & 0x20) ? 4 : 3) : (b) & 7)
+
+#define AA_OP(b) { AA_Z(b), AA_N(b), AA_F(b), AA_R(b) }
+#define BW_OP(b) { BW_Z(b), BW_N(b), 255, 255 }
+#define OP4(M, b) M(b), M((b) + 1), M((b) + 2), M((b) + 3)
+#define OP16(M, b) OP4(M, b), OP4(M, (b) + 4), OP4(M, (b) + 8), OP4(M, (b) + 12)
+#define OP64(M, b) OP16(M, b), OP16(M, (b) + 16), OP16(M, (b) + 32), OP16(M, (b) + 48)
+#define OP256(M) OP64(M, 0), OP64(M, 64), OP64(M, 128), OP64(M, 192)
+
+static const zi_op_t op_aa[256] = { OP256(AA_OP) };
+static const zi_op_t op_bw[256] = { OP256(BW_OP) };
+
 // Decode glyph data -> grayscale buffer (alpha as brightness)
 static int decode_glyph(const uint8_t *data, uint32_t len, uint8_t mode, int width, int height, uint8_t *out) {
-	memset(out, 0, (size_t)width * height);
 	uint32_t total = (uint32_t)width * height;
 	uint32_t wrote = 0;
+	const zi_op_t *ops;
+
+	if(mode == 0x03) { // Anti-aliased
+		ops = op_aa;
+	} else if(mode == 0x01) { // Mono
+		ops = op_bw;
+	} else {
+		fprintf(stderr, "Unknown glyph mode 0x%02X\n", mode);
+		memset(out, 0, total);
+		return -1;
+	}
 
 	for(uint32_t i = 0; i < len && wrote < total; ++i) {
-		uint8_t b = data[i];
-		uint8_t yz = (b >> 6) & 3;
-		uint8_t d	=	b & 0x3F;
-
-		if(mode == 0x03) { // Anti-aliased
-			if(yz == 0x00) {
-				uint8_t opq = (d >> 5) & 1;
-				uint8_t cnt = d & 0x1F;
-				uint8_t val = opq ? 255 : 0;
-				for(uint8_t k=0; k<cnt && wrote<total; ++k) out[wrote++] = val;
-			} else if(yz == 0x01) {
-				uint8_t two = (d >> 5) & 1;
-				uint8_t cnt = d & 0x1F;
-				for(uint8_t k=0; k<cnt && wrote<total; ++k) out[wrote++] = 0;
-				for(uint8_t k=0; k<(two?2:1) && wrote<total; ++k) out[wrote++] = 255;
-			} else if(yz == 0x02) {
-				uint8_t trans = (d >> 3) & 7;
-				uint8_t ccc	 =	d & 7;
-				for(uint8_t k=0; k<trans && wrote<total; ++k) out[wrote++] = 0;
-				if(wrote<total) out[wrote++] = a3_to_a8(ccc);
-			} else { /* 11 */
-				uint8_t ccc = (d >> 3) & 7;
-				uint8_t ddd =	d & 7;
-				if(wrote<total) out[wrote++] = a3_to_a8(ccc);
-				if(wrote<total) out[wrote++] = a3_to_a8(ddd);
-			}
-		} else if(mode == 0x01) { // Mono
-			if(yz == 0x00) {
-				uint8_t opq = (d >> 5) & 1;
-				uint8_t cnt = d & 0x1F;
-				uint8_t val = opq ? 255 : 0;
-				for(uint8_t k=0; k<cnt && wrote<total; ++k) out[wrote++] = val;
-			} else if(yz == 0x01) {
-				uint8_t two = (d >> 5) & 1;
-				uint8_t cnt = d & 0x1F;
-				for(uint8_t k=0; k<cnt && wrote<total; ++k) out[wrote++] = 0;
-				for(uint8_t k=0; k<(two?2:1) && wrote<total; ++k) out[wrote++] = 255;
-			} else if(yz == 0x02) {
-				uint8_t bflag = (d >> 5) & 1;
-				uint8_t cnt	 = d & 0x1F;
-				for(uint8_t k=0; k<cnt && wrote<total; ++k) out[wrote++] = 0;
-				for(uint8_t k=0; k<(bflag?4:3) && wrote<total; ++k) out[wrote++] = 255;
-			} else { /* 11 */
-				uint8_t www = (d >> 3) & 7;
-				uint8_t bbb =	d & 7;
-				for(uint8_t k=0; k<www && wrote<total; ++k) out[wrote++] = 0;
-				for(uint8_t k=0; k<bbb && wrote<total; ++k) out[wrote++] = 255;
-			}
-		} else {
-			fprintf(stderr, "Unknown glyph mode 0x%02X\n", mode);
-			return -1;
+		const zi_op_t *op = &ops[data[i]];
+		uint32_t left = total - wrote;
+		uint32_t z = op->zeros < left ? op->zeros : left;
+		memset(out + wrote, 0, z);
+		wrote += z;
+		if(op->count && wrote < total) {
+			out[wrote++] = op->first;
+			left = total - wrote;
+			uint32_t r = op->count - 1u < left ? op->count - 1u : left;
+			memset(out + wrote, op->rest, r);
+			wrote += r;
 		}
 	}
 
-	if(wrote < total)
+	if(wrote < total) {
 		fprintf(stderr, "Warning: decoded %u/%u pixels\n", wrote, total);
+		memset(out + wrote, 0, total - wrote);
+	}
 	return 0;
 }
 
-// Load ZI (v6) font
-zi_font_t * zi_load(const char *path) {
-	FILE *f = fopen(path, "rb");
-	if(!f) { perror(path); return NULL; }
-	fseek(f, 0, SEEK_END);
-	long szL = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	if(szL <= 0) { fclose(f); return NULL; }
-
-	uint8_t *buf = malloc(szL);
-	fread(buf, 1, szL, f);
-	fclose(f);
+// Start row-by-row decode of stream (mode byte first)
+int zi_rows_begin(zi_rows_t *rs, const uint8_t *stream, uint32_t len, uint8_t width, uint8_t height) {
+	memset(rs, 0, sizeof(zi_rows_t));
+	rs->width = width;
+	rs->height = height;
+	if(len == 0) { // no mode byte, decodes as blank
+		rs->ops = op_bw;
+		return 0;
+	}
+	if(stream[0] == 0x03) {
+		rs->ops = op_aa;
+	} else if(stream[0] == 0x01) {
+		rs->ops = op_bw;
+	} else {
+		fprintf(stderr, "Unknown glyph mode 0x%02X\n", stream[0]);
+		return -1;
+	}
+	rs->data = stream + 1;
+	rs->len = len - 1;
+	return 0;
+}
 
-	uint8_t height = buf[0x07];
-	uint32_t glyph_count = (uint32_t)(buf[0x0C] | (buf[0x0D]<<8) |
-										(buf[0x0E]<<16) | (buf[0x0F]<<24));
-	uint8_t desc_len = buf[0x11];
-	uint32_t data_addr = (uint32_t)(buf[0x18] | (buf[0x19]<<8) |
-									(buf[0x1A]<<16) | (buf[0x1B]<<24));
-	uint8_t flag_align8 = buf[0x21] & 1;
-	uint32_t cmap_off = data_addr + desc_len;
+// Pending span of a row, grown while pixels of the same value follow
+typedef struct {
+	uint8_t x, len, value;
+} span_acc_t;
 
-	zi_glyph_t *glyphs = calloc(glyph_count, sizeof(zi_glyph_t));
-	const uint8_t *cmap = buf + cmap_off;
-	size_t file_size = (size_t)szL;
+// Extend pending span with len pixels of value at x, or flush it and start over
+static inline void span_add(span_acc_t *a, zi_span_fn span, void *ctx, uint8_t y, uint8_t x, uint8_t len, uint8_t value) {
+	if(a->len && a->value == value && a->x + a->len == x) {
+		a->len += len;
+		return;
+	}
+	if(a->len) span(ctx, y, a->x, a->len, a->value);
+	*a = (span_acc_t){ x, value ? len : 0, value };
+}
 
-	// read font name as zero-terminated string
+// Produce one row into line and/or as non-zero spans, 0 when all rows are done.
+// Spans are merged across opcodes, so a run reaches the callback once
+static int rows_step(zi_rows_t *rs, uint8_t *line, zi_span_fn span, void *ctx) {
+	if(rs->row >= rs->height) return 0;
+	const zi_op_t *ops = (const zi_op_t *)rs->ops;
+	uint8_t w = rs->width, y = rs->row;
+	uint8_t x = 0;
+	span_acc_t acc = { 0, 0, 0 };
+	while(x < w) {
+		if(rs->zeros) {
+			uint8_t n = rs->zeros < w - x ? rs->zeros : w - x;
+			if(line) memset(line + x, 0, n);
+			x += n;
+			rs->zeros -= n;
+		} else if(rs->first_due) {
+			if(line) line[x] = rs->first;
+			if(span) span_add(&acc, span, ctx, y, x, 1, rs->first);
+			x++;
+			rs->first_due = 0;
+		} else if(rs->rest) {
+			uint8_t n = rs->rest < w - x ? rs->rest : w - x;
+			if(line) memset(line + x, rs->value, n);
+			if(span) span_add(&acc, span, ctx, y, x, n, rs->value);
+			x += n;
+			rs->rest -= n;
+		} else if(rs->pos < rs->len) {
+			const zi_op_t *op = &ops[rs->data[rs->pos++]];
+			rs->zeros = op->zeros;
+			rs->first_due = op->count != 0;
+			rs->first = op->first;
+			rs->rest = op->count ? op->count - 1 : 0;
+			rs->value = op->rest;
+		} else { // stream ran short, rest is blank
+			if(line) memset(line + x, 0, w - x);
+			break;
+		}
+	}
+	if(acc.len) span(ctx, y, acc.x, acc.len, acc.value);
+	rs->row++;
+	return 1;
+}
+
+// Decode next row into line (width bytes), 0 when all rows are done
+int zi_rows_next(zi_rows_t *rs, uint8_t *line) {
+	return rows_step(rs, line, NULL, NULL);
+}
+
+// Decode next row as calls to span for each non-blank run, 0 when all rows are done
+int zi_rows_next_spans(zi_rows_t *rs, zi_span_fn span, void *ctx) {
+	return rows_step(rs, NULL, span, ctx);
+}
+
+// == PACKED GLYPHS ==
+
+// Bytes of pixel data held by glyph
+size_t zi_glyph_size(const zi_glyph_t *g, uint8_t height) {
+	size_t n = (size_t)g->w * height;
+	if(g->bpp == ZI_BPP1) return (n + 7) / 8;
+	if(g->bpp == ZI_BPP4) return (n + 1) / 2;
+	return n;
+}
+
+// 8-bit value of pixel x, y of glyph in any format
+uint8_t zi_glyph_pixel(const zi_glyph_t *g, uint32_t x, uint32_t y) {
+	size_t i = (size_t)y * g->w + x;
+	if(g->bpp == ZI_BPP1) return (g->data[i >> 3] & (0x80 >> (i & 7))) ? 255 : 0;
+	if(g->bpp == ZI_BPP4) return a3_to_a8((g->data[i >> 1] >> ((i & 1) ? 0 : 4)) & 7);
+	return g->data[i];
+}
+
+// Expand glyph to 8-bit grayscale, out must hold w*height bytes
+void zi_glyph_unpack(const zi_glyph_t *g, uint8_t height, uint8_t *out) {
+	size_t n = (size_t)g->w * height;
+	if(g->bpp == ZI_BPP1) {
+		for(size_t i = 0; i < n; i++) out[i] = (g->data[i >> 3] & (0x80 >> (i & 7))) ? 255 : 0;
+	} else if(g->bpp == ZI_BPP4) {
+		for(size_t i = 0; i < n; i++) out[i] = a3_to_a8((g->data[i >> 1] >> ((i & 1) ? 0 : 4)) & 7);
+	} else {
+		memcpy(out, g->data, n);
+	}
+}
+
+// Pack one decoded 8-bit row at pixel offset i of zeroed packed data
+static void pack_row(uint8_t bpp, uint8_t *dst, size_t i, const uint8_t *line, uint8_t w) {
+	if(bpp == ZI_BPP1) {
+		for(uint8_t x = 0; x < w; x++, i++) {
+			if(line[x] >= 128) dst[i >> 3] |= (uint8_t)(0x80 >> (i & 7));
+		}
+	} else {
+		for(uint8_t x = 0; x < w; x++, i++) {
+			dst[i >> 1] |= (uint8_t)(q3(line[x]) << ((i & 1) ? 0 : 4));
+		}
+	}
+}
+
+static inline uint32_t rd_le16(const uint8_t *p) {
+	return (uint32_t)(p[0] | (p[1]<<8));
+}
+
+static inline uint32_t rd_le24(const uint8_t *p) {
+	return (uint32_t)(p[0] | (p[1]<<8) | (p[2]<<16));
+}
+
+static inline uint32_t rd_le32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+// Map whole file read-only
+static const uint8_t * map_file(const char *path, size_t *size) {
+#ifdef _WIN32
+	HANDLE fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fh == INVALID_HANDLE_VALUE) { fprintf(stderr, "%s: cannot open\n", path); return NULL; }
+	LARGE_INTEGER li;
+	if(!GetFileSizeEx(fh, &li) || li.QuadPart <= 0) { CloseHandle(fh); return NULL; }
+	HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(fh);
+	if(!mh) return NULL;
+	const uint8_t *p = (const uint8_t *)MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mh);
+	if(!p) return NULL;
+	*size = (size_t)li.QuadPart;
+	return p;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) { perror(path); return NULL; }
+	struct stat st;
+	if(fstat(fd, &st) || st.st_size <= 0) { close(fd); return NULL; }
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) { perror(path); return NULL; }
+	*size = (size_t)st.st_size;
+	return (const uint8_t *)p;
+#endif
+}
+
+static void unmap_file(const uint8_t *p, size_t size) {
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(p);
+#else
+	munmap((void *)p, size);
+#endif
+}
+
+// Parse header of ZI (v6) font in buf, name is used for messages
+static zi_file_t * open_buf(const uint8_t *buf, size_t size, const char *name) {
+	if(size < 0x2C) {
+		fprintf(stderr, "%s: too short for ZI header\n", name);
+		return NULL;
+	}
+
+	uint32_t glyph_count = rd_le32(buf + 0x0C);
+	uint8_t desc_len = buf[0x11];
+	uint32_t data_addr = rd_le32(buf + 0x18);
+	uint64_t cmap_off = (uint64_t)data_addr + desc_len;
+	if(cmap_off + (uint64_t)glyph_count * 10 > size) {
+		fprintf(stderr, "%s: charmap exceeds file\n", name);
+		return NULL;
+	}
+
+	zi_file_t *zf = malloc(sizeof(zi_file_t));
 	char *font_name = malloc(desc_len + 1);
+	if(!zf || !font_name) {
+		free(zf);
+		free(font_name);
+		return NULL;
+	}
 	memcpy(font_name, buf + data_addr, desc_len);
 	font_name[desc_len] = '\0';
 
-	for(uint32_t gi = 0; gi < glyph_count; gi++) {
-		const uint8_t *e = cmap + gi*10;
-		uint16_t code = (uint16_t)(e[0] | (e[1]<<8));
-		uint8_t width = e[2];
-		uint32_t start_rel = (uint32_t)(e[5] | (e[6]<<8) | (e[7]<<16));
-		uint16_t data_len = (uint16_t)(e[8] | (e[9]<<8));
+	zf->font_name = font_name;
+	zf->height = buf[0x07];
+	zf->glyph_count = glyph_count;
+	zf->align8 = buf[0x21] & 1;
+	zf->mapped = 0;
+	zf->base = buf;
+	zf->size = size;
+	zf->cmap = buf + cmap_off;
+	return zf;
+}
+
+// Open ZI (v6) font, only header is parsed
+zi_file_t * zi_open(const char *path) {
+	size_t size = 0;
+	const uint8_t *buf = map_file(path, &size);
+	if(!buf) return NULL;
+	zi_file_t *zf = open_buf(buf, size, path);
+	if(!zf) {
+		unmap_file(buf, size);
+		return NULL;
+	}
+	zf->mapped = 1;
+	return zf;
+}
+
+// Open ZI (v6) font held in caller memory, buf must outlive the zi_file_t
+zi_file_t * zi_open_mem(const uint8_t *buf, size_t size) {
+	return open_buf(buf, size, "(memory)");
+}
+
+// Release zi_file_t from zi_open() or zi_open_mem()
+void zi_close(zi_file_t *zf) {
+	if(!zf) return;
+	if(zf->mapped) unmap_file(zf->base, zf->size);
+	free(zf->font_name);
+	free(zf);
+}
+
+// Read charmap entry, returns -1 if stream lies outside file
+int zi_file_entry(const zi_file_t *zf, uint32_t index, zi_entry_t *e) {
+	if(index >= zf->glyph_count) return -1;
+	const uint8_t *m = zf->cmap + index*10;
+	uint32_t start_rel = rd_le24(m + 5);
+	uint64_t start = zf->align8 ? (uint64_t)start_rel * 8 : start_rel;
+	uint64_t glyph_off = (uint64_t)(zf->cmap - zf->base) + start;
+	e->c = (uint16_t)rd_le16(m);
+	e->w = m[2];
+	e->len = (uint16_t)rd_le16(m + 8);
+	if(glyph_off + e->len > zf->size) {
+		e->data = NULL;
+		return -1;
+	}
+	e->data = zf->base + glyph_off;
+	return 0;
+}
+
+// Decode one glyph of opened font, out must hold w*height bytes
+int zi_file_decode(const zi_file_t *zf, uint32_t index, uint8_t *out) {
+	zi_entry_t e;
+	if(zi_file_entry(zf, index, &e)) return -1;
+	if(e.len == 0) { // no mode byte, nothing to draw
+		memset(out, 0, (size_t)e.w * zf->height);
+		return 0;
+	}
+	return decode_glyph(e.data + 1, e.len - 1u, e.data[0], e.w, zf->height, out);
+}
+
+typedef struct {
+	const zi_file_t *zf;
+	const uint64_t *order;
+	zi_glyph_t *glyphs;
+} load_job_t;
+
+static void load_one(void *ctx, uint32_t k, unsigned worker) {
+	load_job_t *job = (load_job_t *)ctx;
+	uint32_t gi = (uint32_t)job->order[k];
+	zi_glyph_t *g = &job->glyphs[gi];
+	(void)worker;
+	if(g->bpp == ZI_BPP8) {
+		zi_file_decode(job->zf, gi, g->data);
+		return;
+	}
+	// Packed: decode row by row and pack at native depth
+	uint8_t line[256];
+	zi_rows_t rs;
+	memset(g->data, 0, zi_glyph_size(g, job->zf->height));
+	if(zi_file_rows(job->zf, gi, &rs)) return;
+	for(size_t i = 0; zi_rows_next(&rs, line); i += g->w) pack_row(g->bpp, g->data, i, line, g->w);
+}
+
+// Start row-by-row decode of one glyph of opened font
+int zi_file_rows(const zi_file_t *zf, uint32_t index, zi_rows_t *rs) {
+	zi_entry_t e;
+	if(zi_file_entry(zf, index, &e)) return -1;
+	return zi_rows_begin(rs, e.data, e.len, e.w, zf->height);
+}
+
+// Load ZI (v6) font
+zi_font_t * zi_load(const char *path) {
+	return zi_load_ex(path, NULL);
+}
 
-		uint32_t start = flag_align8 ? start_rel * 8 : start_rel;
-		uint32_t glyph_off = cmap_off + start;
-		if((uint64_t)glyph_off + data_len > file_size) continue;
+// Load ZI (v6) font with options (NULL for defaults)
+zi_font_t * zi_load_ex(const char *path, const zi_load_opts_t *opts) {
+	size_t size = 0;
+	const uint8_t *buf = map_file(path, &size);
+	if(!buf) return NULL;
+	zi_font_t *font = zi_load_mem(buf, size, opts);
+	unmap_file(buf, size);
+	return font;
+}
 
-		const uint8_t *gdat = buf + glyph_off;
-		uint8_t mode = gdat[0];
-		const uint8_t *payload = gdat + 1;
-		uint32_t plen = data_len - 1;
+// Load ZI (v6) font from caller memory, buf is not referenced after return
+zi_font_t * zi_load_mem(const uint8_t *buf, size_t size, const zi_load_opts_t *opts) {
+	zi_file_t *zf = zi_open_mem(buf, size);
+	if(!zf) return NULL;
 
-		uint8_t *gray = malloc((size_t)width * height);
-		decode_glyph(payload, plen, mode, width, height, gray);
+	uint32_t glyph_count = zf->glyph_count;
+	uint8_t height = zf->height;
+	zi_glyph_t *glyphs = calloc(glyph_count, sizeof(zi_glyph_t));
+	uint64_t *order = malloc((glyph_count ? glyph_count : 1) * sizeof(uint64_t));
+	if(!glyphs || !order) goto fail;
 
-		glyphs[gi].c = code;
-		glyphs[gi].w = width;
-		glyphs[gi].data = gray;
+	// Size the slab from the charmap, bitmaps are placed in codepoint order
+	size_t total = 0;
+	uint32_t valid = 0;
+	for(uint32_t gi = 0; gi < glyph_count; gi++) {
+		zi_entry_t e;
+		if(zi_file_entry(zf, gi, &e)) continue;
+		glyphs[gi].c = e.c;
+		glyphs[gi].w = e.w;
+		if(opts && opts->packed) { // depth follows stream mode
+			glyphs[gi].bpp = (e.len && e.data[0] == 0x03) ? ZI_BPP4 : ZI_BPP1;
+		}
+		total += zi_glyph_size(&glyphs[gi], height);
+		order[valid++] = ((uint64_t)e.c << 32) | gi;
 	}
+	qsort(order, valid, sizeof(uint64_t), cmp_u64);
+
+	uint8_t *slab = malloc(total ? total : 1);
+	if(!slab) goto fail;
+	size_t off = 0;
+	for(uint32_t k = 0; k < valid; k++) {
+		uint32_t gi = (uint32_t)order[k];
+		glyphs[gi].data = slab + off;
+		off += zi_glyph_size(&glyphs[gi], height);
+	}
+
+	// Streams are independent, each job writes its own part of the slab
+	load_job_t job = { zf, order, glyphs };
+	run_parallel(valid, opts ? opts->threads : 1, load_one, &job);
 
 	zi_font_t *font = malloc(sizeof(zi_font_t));
-	font->font_name = font_name;
+	if(!font) {
+		free(slab);
+		goto fail;
+	}
+	free(order);
+	font->font_name = zf->font_name;
 	font->height = height;
 	font->glyph_count = glyph_count;
 	font->glyphs = glyphs;
+	font->index = NULL;
+	font->slab = slab;
+	zi_build_index(font);
 
-	free(buf);
+	// name ownership moves to font
+	zf->font_name = NULL;
+	zi_close(zf);
 	return font;
+
+fail:
+	free(glyphs);
+	free(order);
+	zi_close(zf);
+	return NULL;
 }
 
-// Free memory for zi_font_t from zi_load()
+// Free memory for zi_font_t from zi_load(), or built with per-glyph malloc()
 void zi_free(zi_font_t *font) {
 	if(!font) return;
-	for(uint32_t i = 0; i < font->glyph_count; i++) free(font->glyphs[i].data);
+	if(font->slab) {
+		free(font->slab);
+	} else {
+		for(uint32_t i = 0; i < font->glyph_count; i++) free(font->glyphs[i].data);
+	}
 	free(font->glyphs);
+	zi_free_index(font->index);
 	free(font->font_name);
 	free(font);
 }
 
-// == ZI FONT SAVING/PRODUCTION ==
+// == PIXEL KERNELS ==
 
-typedef struct {
-	uint8_t *buf;
-	uint32_t len, cap;
-} obuf_t;
-
-// Buffer helper
-static int o_put(obuf_t *o, uint8_t b) {
-	if(o->len == o->cap) {
-		uint32_t ncap = o->cap ? (o->cap << 1) : 256;
-		uint8_t *nb = (uint8_t *)realloc(o->buf, ncap);
-		if(!nb) return -1;
-		o->buf = nb;
-		o->cap = ncap;
-	}
-	o->buf[o->len++] = b;
-	return 0;
+static void quant3_c(const uint8_t *src, uint8_t *dst, uint32_t n) {
+	for(uint32_t i = 0; i < n; i++) dst[i] = q3(src[i]);
 }
 
-// == 4-BIT ENCODER ==
+static int binary_c(const uint8_t *src, uint32_t n) {
+	for(uint32_t i = 0; i < n; i++) {
+		uint8_t v = src[i];
+		if(!(v <= 3 || v >= 252)) return 0;
+	}
+	return 1;
+}
+
+// First and one past last pixel >= min in row, first is n if none
+static void span_c(const uint8_t *row, uint32_t n, uint8_t min, uint32_t *first, uint32_t *end) {
+	uint32_t f = n, e = 0;
+	for(uint32_t i = 0; i < n; i++) {
+		if(row[i] >= min) {
+			if(f == n) f = i;
+			e = i + 1;
+		}
+	}
+	*first = f;
+	*end = e;
+}
+
+// Bit per pixel >= 128, LSB first, bits past n are 0
+static void pack1_c(const uint8_t *src, uint64_t *bits, uint32_t n) {
+	for(uint32_t base = 0; base < n; base += 64) {
+		uint32_t cnt = n - base < 64 ? n - base : 64;
+		uint64_t word = 0;
+		for(uint32_t k = 0; k < cnt; k++) word |= (uint64_t)(src[base + k] >> 7) << k;
+		bits[base / 64] = word;
+	}
+}
+
+// Grey level times alpha, rounded: (r + g + b) / 3 * a / 255
+static void gray_c(const uint8_t *rgba, uint8_t *dst, uint32_t n) {
+	for(uint32_t i = 0; i < n; i++, rgba += 4) {
+		uint32_t v = ((uint32_t)rgba[0] + rgba[1] + rgba[2]) / 3;
+		dst[i] = (uint8_t)((v * rgba[3] + 127) / 255);
+	}
+}
+
+#ifdef ZI_X86
+
+// q3 on 16-bit lanes: t = v * 7 + 127, then t / 255 as (t + 1 + (t >> 8)) >> 8
+__attribute__((target("sse2")))
+static inline __m128i q3_x8(__m128i v) {
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(7)), _mm_set1_epi16(127));
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(1)), _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void quant3_sse2(const uint8_t *src, uint8_t *dst, uint32_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = q3_x8(_mm_unpacklo_epi8(v, zero)), hi = q3_x8(_mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	quant3_c(src + i, dst + i, n - i);
+}
+
+// Pixel is not binary when v - 4 (wrapping) is at most 247
+__attribute__((target("sse2")))
+static int binary_sse2(const uint8_t *src, uint32_t n) {
+	const __m128i k4 = _mm_set1_epi8(4), k247 = _mm_set1_epi8((char)247);
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i x = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(src + i)), k4);
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, k247), x))) return 0;
+	}
+	return binary_c(src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void span_sse2(const uint8_t *row, uint32_t n, uint8_t min, uint32_t *first, uint32_t *end) {
+	const __m128i m = _mm_set1_epi8((char)min);
+	uint32_t i = 0, f = n, e = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+		unsigned bits = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, m), v));
+		if(bits) {
+			if(f == n) f = i + (unsigned)__builtin_ctz(bits);
+			e = i + 32 - (unsigned)__builtin_clz(bits);
+		}
+	}
+	for(; i < n; i++) {
+		if(row[i] >= min) {
+			if(f == n) f = i;
+			e = i + 1;
+		}
+	}
+	*first = f;
+	*end = e;
+}
+
+// movemask takes the top bit of each byte, which is v >= 128
+__attribute__((target("sse2")))
+static void pack1_sse2(const uint8_t *src, uint64_t *bits, uint32_t n) {
+	uint32_t w = 0;
+	for(; (w + 1) * 64 <= n; w++) {
+		const __m128i *p = (const __m128i *)(src + w * 64);
+		uint64_t m0 = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(p)), m1 = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(p + 1));
+		uint64_t m2 = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(p + 2)), m3 = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(p + 3));
+		bits[w] = m0 | m1 << 16 | m2 << 32 | m3 << 48;
+	}
+	pack1_c(src + w * 64, bits + w, n - w * 64);
+}
+
+// 8 pixels per step, channels split out of 32-bit lanes into 16-bit lanes.
+// s / 3 as mulhi(s, 43691) >> 1 and t / 255 as above, both exact in range
+__attribute__((target("sse2")))
+static void gray_sse2(const uint8_t *rgba, uint8_t *dst, uint32_t n) {
+	const __m128i ff = _mm_set1_epi32(0xFF);
+	uint32_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)(rgba + i * 4));
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(rgba + i * 4 + 16));
+		__m128i r = _mm_packs_epi32(_mm_and_si128(x0, ff), _mm_and_si128(x1, ff));
+		__m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(x0, 8), ff), _mm_and_si128(_mm_srli_epi32(x1, 8), ff));
+		__m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(x0, 16), ff), _mm_and_si128(_mm_srli_epi32(x1, 16), ff));
+		__m128i a = _mm_packs_epi32(_mm_srli_epi32(x0, 24), _mm_srli_epi32(x1, 24));
+		__m128i v = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_add_epi16(r, g), b), _mm_set1_epi16((short)43691)), 1);
+		__m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(127));
+		t = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(1)), _mm_srli_epi16(t, 8)), 8);
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(t, t));
+	}
+	gray_c(rgba + i * 4, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i q3_x16(__m256i v) {
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(v, _mm256_set1_epi16(7)), _mm256_set1_epi16(127));
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t, _mm256_set1_epi16(1)), _mm256_srli_epi16(t, 8)), 8);
+}
 
+// Unpack and pack both work per 128-bit lane, so byte order is kept
+__attribute__((target("avx2")))
+static void quant3_avx2(const uint8_t *src, uint8_t *dst, uint32_t n) {
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i lo = q3_x16(_mm256_unpacklo_epi8(v, zero)), hi = q3_x16(_mm256_unpackhi_epi8(v, zero));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+	quant3_sse2(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int binary_avx2(const uint8_t *src, uint32_t n) {
+	const __m256i k4 = _mm256_set1_epi8(4), k247 = _mm256_set1_epi8((char)247);
+	uint32_t i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(src + i)), k4);
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, k247), x))) return 0;
+	}
+	return binary_sse2(src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void pack1_avx2(const uint8_t *src, uint64_t *bits, uint32_t n) {
+	uint32_t w = 0;
+	for(; (w + 1) * 64 <= n; w++) {
+		const __m256i *p = (const __m256i *)(src + w * 64);
+		uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256(p));
+		uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256(p + 1));
+		bits[w] = lo | hi << 32;
+	}
+	pack1_c(src + w * 64, bits + w, n - w * 64);
+}
+
+__attribute__((target("avx2")))
+static void span_avx2(const uint8_t *row, uint32_t n, uint8_t min, uint32_t *first, uint32_t *end) {
+	const __m256i m = _mm256_set1_epi8((char)min);
+	uint32_t i = 0, f = n, e = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(row + i));
+		unsigned bits = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, m), v));
+		if(bits) {
+			if(f == n) f = i + (unsigned)__builtin_ctz(bits);
+			e = i + 32 - (unsigned)__builtin_clz(bits);
+		}
+	}
+	if(i < n) {
+		uint32_t tf, te;
+		span_sse2(row + i, n - i, min, &tf, &te);
+		if(te) {
+			if(f == n) f = i + tf;
+			e = i + te;
+		}
+	}
+	*first = f;
+	*end = e;
+}
+
+#endif
+
+// Kernels for this CPU, picked once
 typedef struct {
-	uint32_t cost;
-	uint8_t tag;
-	uint8_t p0;
-	uint8_t p1;
-} aastep_t;
+	void (*quant3)(const uint8_t *src, uint8_t *dst, uint32_t n);
+	int (*binary)(const uint8_t *src, uint32_t n);
+	void (*span)(const uint8_t *row, uint32_t n, uint8_t min, uint32_t *first, uint32_t *end);
+	void (*gray)(const uint8_t *rgba, uint8_t *dst, uint32_t n);
+	void (*pack1)(const uint8_t *src, uint64_t *bits, uint32_t n);
+} zi_kernels_t;
+
+// gray has no AVX2 version, it runs once per atlas page
+static zi_kernels_t kernels = { quant3_c, binary_c, span_c, gray_c, pack1_c };
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void kernels_init(void) {
+#ifdef ZI_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		kernels = (zi_kernels_t){ quant3_avx2, binary_avx2, span_avx2, gray_sse2, pack1_avx2 };
+	} else if(__builtin_cpu_supports("sse2")) {
+		kernels = (zi_kernels_t){ quant3_sse2, binary_sse2, span_sse2, gray_sse2, pack1_sse2 };
+	}
+#endif
+}
 
-static uint32_t runlen_aa(const uint32_t n, const uint8_t *flag, uint32_t start, uint32_t maxlen) {
-	uint32_t j = start, lim = start + maxlen;
-	while(j < n && j < lim && flag[j]) j++;
-	return j - start;
+// Quantize 8-bit pixels to 3-bit levels
+void zi_quantize3(const uint8_t *src, uint8_t *dst, uint32_t n) {
+	pthread_once(&kernels_once, kernels_init);
+	kernels.quant3(src, dst, n);
 }
 
-// Quantize 8-bit to 3-bit
-static inline uint8_t q3(uint8_t v8) {
-	return (uint8_t)((v8 * 7 + 127) / 255);
+// Nonzero if every pixel is near 0 or near 255, so mono encoding is exact
+int zi_is_binary(const uint8_t *px, uint32_t n) {
+	pthread_once(&kernels_once, kernels_init);
+	return kernels.binary(px, n);
 }
 
-// Encode anti-aliased glyph
-static int encode_glyph_aa_dp(const uint8_t *src8, uint8_t w, uint8_t h, uint8_t **out, uint32_t *out_len) {
-	const uint32_t n = (uint32_t)w * h;
-	uint8_t *a = (uint8_t *)malloc(n);
-	if(!a) return -1;
-	for(uint32_t i = 0; i < n; i++) a[i] = q3(src8[i]);
+// RGBA8 pixels to 8-bit grey, premultiplied by alpha
+void zi_rgba_to_gray(const uint8_t *rgba, uint8_t *dst, uint32_t n) {
+	pthread_once(&kernels_once, kernels_init);
+	kernels.gray(rgba, dst, n);
+}
 
-	// DP arrays
-	aastep_t *step = (aastep_t *)malloc((n + 1) * sizeof(aastep_t));
-	if(!step) {
-		free(a);
-		return -1;
+// Bounding box x0, y0, x1, y1 (exclusive) of pixels >= min, all 0 and returns 0 if none
+int zi_bbox(const uint8_t *px, uint32_t w, uint32_t h, uint8_t min, uint32_t box[4]) {
+	return zi_bbox_stride(px, w, h, w, min, box);
+}
+
+// Same, for a w*h rect in an image with rows stride bytes apart
+int zi_bbox_stride(const uint8_t *px, uint32_t w, uint32_t h, uint32_t stride, uint8_t min, uint32_t box[4]) {
+	uint32_t x0 = w, y0 = h, x1 = 0, y1 = 0;
+	pthread_once(&kernels_once, kernels_init);
+	for(uint32_t y = 0; y < h; y++) {
+		uint32_t f, e;
+		kernels.span(px + (size_t)y * stride, w, min, &f, &e);
+		if(!e) continue;
+		if(f < x0) x0 = f;
+		if(e > x1) x1 = e;
+		if(y < y0) y0 = y;
+		y1 = y + 1;
 	}
-	for(uint32_t i = 0; i <= n; i++) step[i].cost = UINT32_MAX;
-	step[n].cost = 0;
-	step[n].tag = 0xFF;
+	if(!y1) x0 = y0 = 0;
+	box[0] = x0;
+	box[1] = y0;
+	box[2] = x1;
+	box[3] = y1;
+	return y1 != 0;
+}
 
-	// Precompute run lengths of 0 and 7 for fast 00/01/10 checks
-	uint8_t is_zero[n ? n : 1], is_opaque[n ? n : 1];
-	for(uint32_t i = 0; i < n; i++) {
-		is_zero[i] = (a[i] == 0);
-		is_opaque[i] = (a[i] == 7);
+// == ZI FONT SAVING/PRODUCTION ==
+
+// == ENCODER DP STATE ==
+
+// DP state as parallel arrays, one entry per position 0..n
+typedef struct {
+	uint64_t *bits;  // mono bitplane, 64 pixels per word
+	uint32_t *ends;  // mono run ends
+	uint32_t *cost;  // bytes to encode rest of glyph from here
+	uint8_t *tag;    // chosen opcode
+	uint8_t *p0;
+	uint8_t *p1;
+	uint8_t *zrun;   // transparent run starting here (capped at 255)
+	uint8_t *orun;   // opaque run starting here (capped at 255)
+	uint8_t *a;      // quantized pixels
+	uint8_t *m;      // lossy: levels each pixel may take
+	void *block;     // single allocation holding all of the above
+} dp_t;
+
+static int dp_alloc(dp_t *dp, uint32_t n) {
+	size_t m = (size_t)n + 1, words = ((size_t)n + 63) / 64;
+	uint8_t *p = (uint8_t *)malloc(words * sizeof(uint64_t) + m * (2 * sizeof(uint32_t) + 7));
+	if(!p) return -1;
+	dp->block = p;
+	dp->bits = (uint64_t *)p; p += words * sizeof(uint64_t);
+	dp->cost = (uint32_t *)p; p += m * sizeof(uint32_t);
+	dp->ends = (uint32_t *)p; p += m * sizeof(uint32_t);
+	dp->tag = p; p += m;
+	dp->p0 = p; p += m;
+	dp->p1 = p; p += m;
+	dp->zrun = p; p += m;
+	dp->orun = p; p += m;
+	dp->a = p; p += m;
+	dp->m = p;
+	return 0;
+}
+
+// Run lengths of zv and ov from every position, one backward pass
+static void dp_runs(dp_t *dp, uint32_t n, uint8_t zv, uint8_t ov) {
+	const uint8_t *a = dp->a;
+	dp->zrun[n] = 0;
+	dp->orun[n] = 0;
+	for(int32_t i = (int32_t)n - 1; i >= 0; --i) {
+		uint8_t z = dp->zrun[i + 1], o = dp->orun[i + 1];
+		dp->zrun[i] = a[i] == zv ? (z < 255 ? z + 1 : 255) : 0;
+		dp->orun[i] = a[i] == ov ? (o < 255 ? o + 1 : 255) : 0;
 	}
+}
+
+// Sliding minimum of cost over run ends i+1..i+31, back is the lowest cost
+// at the shortest length, which is the same pick as trying L = 1..31 in order
+typedef struct {
+	uint32_t at[32];
+	uint8_t front, count;
+} rwin_t;
+
+static inline void rwin_push(rwin_t *w, const uint32_t *cost, uint32_t j) {
+	while(w->count && cost[w->at[w->front]] >= cost[j]) {
+		w->front = (w->front + 1) & 31;
+		w->count--;
+	}
+	w->front = (w->front - 1) & 31;
+	w->at[w->front] = j;
+	w->count++;
+}
+
+static inline uint32_t rwin_best(rwin_t *w, uint32_t last) {
+	while(w->at[(w->front + w->count - 1) & 31] > last) w->count--;
+	return w->at[(w->front + w->count - 1) & 31];
+}
+
+// == 4-BIT ENCODER ==
 
-	// DP from end to start
+// Optimal opcodes for anti-aliased glyph, chosen from end to start
+static void solve_aa(dp_t *dp, uint32_t n) {
+	const uint8_t *a = dp->a;
+	uint32_t *cost = dp->cost;
+	cost[n] = 0;
+	dp->tag[n] = 0xFF;
+
+	rwin_t win = { { 0 }, 0, 0 };
 	for(int32_t i = (int32_t)n - 1; i >= 0; --i) {
 		uint32_t best = UINT32_MAX;
 		uint8_t btag = 0, p0 = 0, p1 = 0;
+		uint32_t zr = dp->zrun[i];
 
 		// 00: run of 0 or 7, len 1..31
 		if(a[i] == 0 || a[i] == 7) {
-			uint8_t v = a[i];
-			const uint32_t rl = runlen_aa(n, v == 0 ? is_zero : is_opaque, (uint32_t)i, 31);
-			for(uint32_t L = 1; L <= rl; ++L) {
-				uint32_t cand = 1 + step[i + L].cost;
-				if(cand < best) {
-					best = cand;
-					btag = 0;
-					p0 = (v == 7);
-					p1 = (uint8_t)L;
-				}
-			}
+			uint32_t rl = a[i] == 0 ? zr : dp->orun[i];
+			if(rl == 1) win.count = 0; // last pixel of run, start new window
+			rwin_push(&win, cost, (uint32_t)i + 1);
+			uint32_t j = rwin_best(&win, (uint32_t)i + (rl < 31 ? rl : 31));
+			best = 1 + cost[j];
+			btag = 0;
+			p0 = (a[i] == 7);
+			p1 = (uint8_t)(j - (uint32_t)i);
 		}
 
 		// 01: trans run (1..31) then 1 or 2 opaque 7s
-		if(a[i] == 0) {
-			uint32_t t = runlen_aa(n, is_zero, (uint32_t)i, 31);
-			if(t >= 1) {
-				uint32_t j = (uint32_t)i + t;
-				if(j < n && a[j] == 7) {
-					// one opaque
-					uint32_t cand1 = 1 + step[j + 1].cost;
-					if(cand1 < best) {
+		if(zr) {
+			uint32_t t = zr < 31 ? zr : 31;
+			uint32_t j = (uint32_t)i + t;
+			if(dp->orun[j] >= 1) {
+				// one opaque
+				uint32_t cand1 = 1 + cost[j + 1];
+				if(cand1 < best) {
 					best = cand1;
 					btag = 1;
 					p0 = 0;
 					p1 = (uint8_t)t;
-					}
-					// two opaque if available
-					if(j + 1 < n && a[j + 1] == 7) {
-					uint32_t cand2 = 1 + step[j + 2].cost;
+				}
+				// two opaque if available
+				if(dp->orun[j] >= 2) {
+					uint32_t cand2 = 1 + cost[j + 2];
 					if(cand2 < best) {
 						best = cand2;
 						btag = 1;
 						p0 = 1;
 						p1 = (uint8_t)t;
 					}
-					}
 				}
 			}
 		}
 
 		// 10: short (0..7) trans then one mid-tone (1..6)
-		{
-			uint32_t t = 0;
-			while(t < 8) {
-				uint32_t j = (uint32_t)i + t;
-				if(j >= n || a[j] != 0) break;
-				t++;
-			}
-			if(t <= 7) {
-				uint32_t j = (uint32_t)i + t;
-				if(j < n && a[j] != 0 && a[j] != 7) {
-					uint32_t cand = 1 + step[j + 1].cost;
-					if(cand < best) {
-						best = cand;
-						btag = 2;
-						p0 = (uint8_t)t;
-						p1 = (uint8_t)(a[j] & 7);
-					}
+		if(zr <= 7) {
+			uint32_t j = (uint32_t)i + zr;
+			if(j < n && a[j] != 7) {
+				uint32_t cand = 1 + cost[j + 1];
+				if(cand < best) {
+					best = cand;
+					btag = 2;
+					p0 = (uint8_t)zr;
+					p1 = a[j];
 				}
 			}
 		}
 
-		// 11: two alphas (any)
+		// 11: two alphas (any), trailing pad allowed
 		{
-			uint8_t c = a[i] & 7;
-			uint8_t d = ((uint32_t)(i + 1) < n) ? (a[i + 1] & 7) : 0;
-			uint32_t adv = (i + 1 < (int32_t)n) ? 2 : 2; // allow trailing pad
-			uint32_t next = (uint32_t)i + adv;
+			uint32_t next = (uint32_t)i + 2;
 			if(next > n) next = n;
-			uint32_t cand = 1 + step[next].cost;
+			uint32_t cand = 1 + cost[next];
 			if(cand < best) {
 				best = cand;
 				btag = 3;
-				p0 = c;
-				p1 = d;
+				p0 = a[i];
+				p1 = ((uint32_t)(i + 1) < n) ? a[i + 1] : 0;
 			}
 		}
 
-		step[i].cost = best;
-		step[i].tag = btag;
-		step[i].p0 = p0;
-		step[i].p1 = p1;
+		cost[i] = best;
+		dp->tag[i] = btag;
+		dp->p0[i] = p0;
+		dp->p1[i] = p1;
 	}
+}
 
-	// Rebuild
-	obuf_t o = { 0 };
-	if(o_put(&o, 0x03)) {
-		free(a);
-		free(step);
-		return -1;
-	}
+// Write anti-aliased stream for opcodes chosen at dp positions
+static uint32_t emit_aa(const dp_t *dp, uint32_t n, uint8_t *out) {
+	uint32_t len = 0;
+	out[len++] = 0x03;
 
 	uint32_t i = 0;
 	while(i < n) {
-		uint8_t tag = step[i].tag;
-		uint8_t A = step[i].p0, B = step[i].p1;
+		uint8_t tag = dp->tag[i];
+		uint8_t A = dp->p0[i], B = dp->p1[i];
 		uint8_t b;
 		if(tag == 0) { // 00 b xxxxx
 			// A: b (0=trans,1=opaque), B: len
@@ -340,248 +1194,947 @@ static int encode_glyph_aa_dp(const uint8_t *src8, uint8_t w, uint8_t h, uint8_t
 			i += 2;
 			if(i > n) i = n; // stay safe
 		}
-		if(o_put(&o, b)) {
-			free(a);
-			free(step);
-			free(o.buf);
-			return -1;
+		out[len++] = b;
+	}
+	return len;
+}
+
+// 1-BIT ENCODER
+
+static inline unsigned ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+	return (unsigned)__builtin_ctzll(x);
+#else
+	unsigned k = 0;
+	while(!(x & 1)) { x >>= 1; k++; }
+	return k;
+#endif
+}
+
+// Pack mono glyph into bitplane, then find run ends a word at a time.
+// Runs alternate, run r has value v0 ^ (r & 1). Returns number of runs
+static uint32_t bw_runs(dp_t *dp, const uint8_t *src8, uint32_t n, uint8_t *v0) {
+	uint64_t *bits = dp->bits;
+	uint32_t words = (n + 63) / 64, runs = 0;
+	pthread_once(&kernels_once, kernels_init);
+	kernels.pack1(src8, bits, n);
+
+	uint32_t s = 0;
+	while(s < n) {
+		// run of v from s ends at first bit that differs, bits past n are 0
+		uint64_t v = (bits[s >> 6] >> (s & 63)) & 1 ? ~0ull : 0;
+		uint32_t wi = s >> 6;
+		uint64_t diff = (bits[wi] ^ v) >> (s & 63);
+		uint32_t e;
+		if(diff) {
+			e = s + ctz64(diff);
+		} else {
+			for(wi++; wi < words && !(bits[wi] ^ v); wi++);
+			e = wi < words ? wi * 64 + ctz64(bits[wi] ^ v) : words * 64;
+		}
+		if(e > n) e = n;
+		dp->ends[runs++] = e;
+		s = e;
+	}
+	*v0 = n ? (uint8_t)(bits[0] & 1) : 0;
+	return runs;
+}
+
+// Inside a run only opcode 00 is ever best, so cost k pixels before the run
+// end is 1 + the lowest cost 1..31 pixels on. That repeats every 31 pixels
+// once it no longer sees past the run end, from k = 32 in opaque runs and
+// k = 63 in transparent ones (where 01, 10 and 11 still matter up to 31).
+// Solved exactly up to X = 31 or 62, deeper positions map to one of those
+static inline uint32_t bw_base(uint32_t k, uint32_t x) {
+	uint32_t k0 = x - 30;
+	return k0 + (k - k0) % 31;
+}
+
+// Optimal opcodes at one position, k pixels before the end e of its run of v,
+// nl is the length of the run after it
+static inline void bw_step(dp_t *dp, uint32_t i, uint32_t k, uint8_t v, uint32_t e, uint32_t nl, rwin_t *win) {
+	uint32_t *cost = dp->cost;
+	uint32_t best, zr = v ? 0 : k;
+	uint8_t tag = 0, p0 = v, p1;
+
+	// 00 b xxxxx: run of val (0 or 1), len 1..31
+	{
+		if(k == 1) win->count = 0; // last pixel of run, start new window
+		rwin_push(win, cost, i + 1);
+		uint32_t j = rwin_best(win, i + (k < 31 ? k : 31));
+		best = 1 + cost[j];
+		p1 = (uint8_t)(j - i);
+	}
+
+	if(zr) {
+		uint32_t t = zr < 31 ? zr : 31;
+		uint32_t j = i + t;
+		uint32_t o = j == e ? nl : 0;
+
+		// 01 b xxxxx: t trans (1..31) then 1 or 2 opaque
+		if(o >= 1) {
+			uint32_t cand1 = 1 + cost[j + 1]; // one opaque
+			if(cand1 < best) {
+				best = cand1;
+				tag = 1;
+				p0 = 0;
+				p1 = (uint8_t)t;
+			}
+			if(o >= 2) {
+				uint32_t cand2 = 1 + cost[j + 2]; // two opaque
+				if(cand2 < best) {
+					best = cand2;
+					tag = 1;
+					p0 = 1;
+					p1 = (uint8_t)t;
+				}
+			}
+		}
+
+		// 10 b xxxxx: t trans then 3 (b=0) or 4 (b=1) opaque
+		if(o >= 3) {
+			uint32_t cand3 = 1 + cost[j + 3]; // +3 opaque
+			if(cand3 < best) {
+				best = cand3;
+				tag = 2;
+				p0 = 0;
+				p1 = (uint8_t)t;
+			}
+			if(o >= 4) {
+				uint32_t cand4 = 1 + cost[j + 4]; // +4 opaque
+				if(cand4 < best) {
+					best = cand4;
+					tag = 2;
+					p0 = 1;
+					p1 = (uint8_t)t;
+				}
+			}
+		}
+	}
+
+	// 11 www bbb: www trans (0..7), then bbb opaque (0..7)
+	{
+		uint32_t t = zr < 7 ? zr : 7;
+		uint32_t o = v ? k : (t == zr ? nl : 0);
+		if(o > 7) o = 7;
+		uint32_t adv = t + o;
+		if(adv > 0) {
+			uint32_t cand = 1 + cost[i + adv];
+			if(cand < best) {
+				best = cand;
+				tag = 3;
+				p0 = (uint8_t)t;
+				p1 = (uint8_t)o;
+			}
+		}
+	}
+
+	cost[i] = best;
+	dp->tag[i] = tag;
+	dp->p0[i] = p0;
+	dp->p1[i] = p1;
+}
+
+// Optimal opcodes for mono glyph, run by run from the end. Only the last
+// X positions of a run are solved, and the first 8 that opcodes ending in
+// the run before may land on; emit_bw maps the rest
+static void solve_bw(dp_t *dp, uint32_t n, uint32_t runs, uint8_t v0) {
+	uint32_t *cost = dp->cost;
+	cost[n] = 0;
+	dp->tag[n] = 0xFF;
+
+	uint32_t e = n, nl = 0;
+	for(uint32_t r = runs; r-- > 0; ) {
+		uint32_t s = r ? dp->ends[r - 1] : 0;
+		uint8_t v = v0 ^ (r & 1);
+		uint32_t x = v ? 31 : 62;
+		uint32_t lo = e - s > x ? e - x : s;
+
+		rwin_t win = { { 0 }, 0, 0 };
+		for(uint32_t i = e; i-- > lo; ) bw_step(dp, i, e - i, v, e, nl, &win);
+		for(uint32_t i = s; i < lo && i < s + 8; i++) {
+			uint32_t k = e - i, b = e - bw_base(k, x);
+			cost[i] = cost[b] + (k - (e - b)) / 31;
+			dp->tag[i] = 0;
+			dp->p0[i] = v;
+			dp->p1[i] = dp->p1[b];
+		}
+		nl = e - s;
+		e = s;
+	}
+}
+
+// Write mono stream for opcodes chosen by solve_bw
+static uint32_t emit_bw(const dp_t *dp, uint32_t n, uint8_t v0, uint8_t *out) {
+	uint32_t len = 0, r = 0;
+	out[len++] = 0x01;
+
+	uint32_t i = 0;
+	while(i < n) {
+		while(dp->ends[r] <= i) r++;
+		uint32_t e = dp->ends[r], x = (v0 ^ (r & 1)) ? 31 : 62, at = i;
+		if(e - i > x) at = e - bw_base(e - i, x); // same opcode as there
+		uint8_t tag = dp->tag[at], A = dp->p0[at], B = dp->p1[at];
+		uint8_t b;
+		if(tag == 0) { // 00 b xxxxx
+			b = (0u << 6) | ((A & 1) << 5) | (B & 31);
+			i += B;
+		} else if(tag == 1) { // 01 b xxxxx
+			b = (1u << 6) | ((A & 1) << 5) | (B & 31);
+			i += B + 1 + (A ? 1 : 0);
+		} else if(tag == 2) { // 10 b xxxxx
+			b = (2u << 6) | ((A & 1) << 5) | (B & 31);
+			i += B + (A ? 4 : 3);
+		} else { // 11 www bbb
+			b = (3u << 6) | ((A & 7) << 3) | (B & 7);
+			i += A + B;
+		}
+		out[len++] = b;
+	}
+	return len;
+}
+
+// == FAST ENCODERS ==
+
+// Single pass, longest opcode at each step, written straight to out.
+// Ties go to the opcode listed first, as in the DP
+
+// Fast anti-aliased stream from quantized pixels
+static uint32_t fast_aa(const uint8_t *a, uint32_t n, uint8_t *out) {
+	uint32_t len = 0, i = 0;
+	out[len++] = 0x03;
+	while(i < n) {
+		uint8_t v = a[i];
+		if(v == 0) {
+			uint32_t z = 1;
+			while(z < 32 && i + z < n && !a[i + z]) z++;
+			if(z <= 31 && i + z < n) {
+				uint8_t w = a[i + z];
+				if(w == 7) { // 01: zeros then 1 or 2 opaque
+					uint32_t two = i + z + 1 < n && a[i + z + 1] == 7;
+					out[len++] = (uint8_t)((1u << 6) | (two << 5) | z);
+					i += z + 1 + two;
+					continue;
+				}
+				if(z <= 7) { // 10: zeros then mid-tone
+					out[len++] = (uint8_t)((2u << 6) | (z << 3) | w);
+					i += z + 1;
+					continue;
+				}
+			}
+			if(z > 31) z = 31;
+			out[len++] = (uint8_t)z; // 00 0
+			i += z;
+		} else if(v == 7 && (i + 1 == n || a[i + 1] == 7)) {
+			uint32_t o = 1;
+			while(o < 31 && i + o < n && a[i + o] == 7) o++;
+			out[len++] = (uint8_t)((1u << 5) | o); // 00 1
+			i += o;
+		} else if(i + 1 == n) { // 10: last pixel, mid-tone
+			out[len++] = (uint8_t)((2u << 6) | v);
+			i++;
+		} else { // 11: two alphas
+			out[len++] = (uint8_t)((3u << 6) | (v << 3) | a[i + 1]);
+			i += 2;
+		}
+	}
+	return len;
+}
+
+// Fast mono stream over the runs from bw_runs
+static uint32_t fast_bw(const dp_t *dp, uint32_t n, uint32_t runs, uint8_t v0, uint8_t *out) {
+	uint32_t len = 0, i = 0, r = 0;
+	out[len++] = 0x01;
+	while(i < n) {
+		while(dp->ends[r] <= i) r++;
+		uint32_t e = dp->ends[r], zr = e - i;
+		if(v0 ^ (r & 1)) { // 00 1, 11 never covers more
+			uint32_t o = zr < 31 ? zr : 31;
+			out[len++] = (uint8_t)((1u << 5) | o);
+			i += o;
+			continue;
+		}
+		uint32_t nl = r + 1 < runs ? dp->ends[r + 1] - e : 0;
+		uint32_t t = zr < 31 ? zr : 31, o = t == zr ? nl : 0;
+		uint32_t t7 = zr < 7 ? zr : 7, o7 = t7 == zr ? (nl < 7 ? nl : 7) : 0;
+		uint8_t b = (uint8_t)t; // 00 0
+		uint32_t adv = t;
+		if(o >= 3) { // 10: t zeros then 3 or 4 opaque
+			b = (uint8_t)((2u << 6) | ((o >= 4) << 5) | t);
+			adv = t + (o >= 4 ? 4 : 3);
+		} else if(o) { // 01: t zeros then 1 or 2 opaque
+			b = (uint8_t)((1u << 6) | ((o >= 2) << 5) | t);
+			adv = t + (o >= 2 ? 2 : 1);
+		}
+		if(t7 + o7 > adv) { // 11: up to 7 zeros then up to 7 opaque
+			b = (uint8_t)((3u << 6) | (t7 << 3) | o7);
+			adv = t7 + o7;
+		}
+		out[len++] = b;
+		i += adv;
+	}
+	return len;
+}
+
+// Encode anti-aliased glyph at effort level, returns stream length
+static uint32_t encode_glyph_aa(dp_t *dp, const uint8_t *src8, uint32_t n, uint8_t level, uint8_t *out) {
+	zi_quantize3(src8, dp->a, n);
+	if(level < ZI_LEVEL_BEST) return fast_aa(dp->a, n, out);
+	dp_runs(dp, n, 0, 7);
+	solve_aa(dp, n);
+	return emit_aa(dp, n, out);
+}
+
+// Encode mono glyph at effort level, returns stream length
+static uint32_t encode_glyph_bw(dp_t *dp, const uint8_t *src8, uint32_t n, uint8_t level, uint8_t *out) {
+	uint8_t v0;
+	uint32_t runs = bw_runs(dp, src8, n, &v0);
+	if(level < ZI_LEVEL_BEST) return fast_bw(dp, n, runs, v0, out);
+	solve_bw(dp, n, runs, v0);
+	return emit_bw(dp, n, v0, out);
+}
+
+// == LOSSY ENCODER ==
+
+#define RD_Z 1 // pixel may be transparent
+#define RD_O 2 // pixel may be opaque, bits 2..4 hold usable mid-tone (1..6) or 0
+#define RD_BYTE (1u << 16) // cost of one opcode, low bits count pixels off nearest level
+
+// Nearest levels, levels each pixel may take within max_err of source and
+// runs of pixels that may be transparent or opaque
+static void rd_prepare(dp_t *dp, const uint8_t *src8, uint32_t n, uint8_t max_err) {
+	dp->zrun[n] = 0;
+	dp->orun[n] = 0;
+	for(int32_t i = (int32_t)n - 1; i >= 0; --i) {
+		int v = src8[i];
+		uint8_t q = q3((uint8_t)v), m = 0, mid = 0;
+		if(q == 0 || v <= max_err) m |= RD_Z;
+		if(q == 7 || 255 - v <= max_err) m |= RD_O;
+		if(q >= 1 && q <= 6) mid = q;
+		else if(q == 0 && a3_to_a8(1) - v <= max_err) mid = 1;
+		else if(q == 7 && v - a3_to_a8(6) <= max_err) mid = 6;
+		dp->a[i] = q;
+		dp->m[i] = (uint8_t)(m | (mid << 2));
+
+		uint8_t z = dp->zrun[i + 1], o = dp->orun[i + 1];
+		dp->zrun[i] = (m & RD_Z) ? (z < 255 ? z + 1 : 255) : 0;
+		dp->orun[i] = (m & RD_O) ? (o < 255 ? o + 1 : 255) : 0;
+	}
+}
+
+#define RD_TRY(c, t, x, y) if((c) < best) { best = (c); btag = (t); p0 = (uint8_t)(x); p1 = (uint8_t)(y); }
+
+// Optimal opcodes for anti-aliased glyph where pixels may take any level
+// allowed by rd_prepare: fewest bytes, then fewest pixels off nearest level
+static void solve_aa_rd(dp_t *dp, uint32_t n) {
+	const uint8_t *a = dp->a, *m = dp->m;
+	uint32_t *cost = dp->cost;
+	cost[n] = 0;
+	dp->tag[n] = 0xFF;
+
+	for(int32_t i = (int32_t)n - 1; i >= 0; --i) {
+		uint32_t zr = dp->zrun[i], orr = dp->orun[i], best, chg;
+		uint8_t btag, p0, p1;
+
+		// 11: two alphas at nearest level, trailing pad allowed
+		best = RD_BYTE + cost[(uint32_t)i + 2 < n ? (uint32_t)i + 2 : n];
+		btag = 3;
+		p0 = a[i];
+		p1 = ((uint32_t)(i + 1) < n) ? a[i + 1] : 0;
+
+		// 10: short (0..7) trans then one mid-tone (1..6)
+		chg = 0;
+		for(uint32_t t = 0; t <= (zr < 7 ? zr : 7); t++) {
+			uint32_t j = (uint32_t)i + t;
+			if(t) chg += a[j - 1] != 0;
+			if(j < n && (m[j] >> 2)) {
+				uint8_t mid = m[j] >> 2;
+				RD_TRY(RD_BYTE + chg + (mid != a[j]) + cost[j + 1], 2, t, mid);
+			}
+		}
+
+		// 01: trans run (1..31) then 1 or 2 opaque
+		chg = 0;
+		for(uint32_t t = 1; t <= (zr < 31 ? zr : 31); t++) {
+			uint32_t j = (uint32_t)i + t;
+			chg += a[j - 1] != 0;
+			if(dp->orun[j] >= 1) {
+				uint32_t c1 = chg + (a[j] != 7);
+				RD_TRY(RD_BYTE + c1 + cost[j + 1], 1, 0, t);
+				if(dp->orun[j] >= 2) RD_TRY(RD_BYTE + c1 + (a[j + 1] != 7) + cost[j + 2], 1, 1, t);
+			}
+		}
+
+		// 00: run of 0 or 7, len 1..31
+		chg = 0;
+		for(uint32_t l = 1; l <= (zr < 31 ? zr : 31); l++) {
+			chg += a[(uint32_t)i + l - 1] != 0;
+			RD_TRY(RD_BYTE + chg + cost[(uint32_t)i + l], 0, 0, l);
+		}
+		chg = 0;
+		for(uint32_t l = 1; l <= (orr < 31 ? orr : 31); l++) {
+			chg += a[(uint32_t)i + l - 1] != 7;
+			RD_TRY(RD_BYTE + chg + cost[(uint32_t)i + l], 0, 1, l);
+		}
+
+		cost[i] = best;
+		dp->tag[i] = btag;
+		dp->p0[i] = p0;
+		dp->p1[i] = p1;
+	}
+}
+
+#undef RD_TRY
+
+// Encode glyph allowing each pixel within max_err of source, always optimal.
+// Glyphs where every pixel may be transparent or opaque also try mono and
+// keep it when shorter, mono rounds each pixel to the nearer of the two
+static uint32_t encode_glyph_rd(dp_t *dp, const uint8_t *src8, uint32_t n, uint8_t max_err, uint8_t *out) {
+	rd_prepare(dp, src8, n, max_err);
+	solve_aa_rd(dp, n);
+	uint32_t len = emit_aa(dp, n, out);
+
+	for(uint32_t i = 0; i < n; i++) {
+		if(!(dp->m[i] & (RD_Z | RD_O))) return len;
+	}
+	uint8_t v0;
+	uint32_t runs = bw_runs(dp, src8, n, &v0);
+	solve_bw(dp, n, runs, v0);
+	if(1 + dp->cost[0] < len) len = emit_bw(dp, n, v0, out);
+	return len;
+}
+
+// == ENCODER CONTEXT ==
+
+// Scratch for encoding glyphs up to max_n pixels, one per thread
+struct zi_encoder_ctx {
+	uint32_t max_n;
+	dp_t dp;
+	uint8_t *unpacked;  // 8-bit copy of packed glyph
+	uint8_t *out;       // encoded stream, every opcode covers at least one pixel
+	uint8_t *check;     // lossy: decoded stream, allocated on first use
+	uint8_t max_err;    // lossy: pixel error allowed, 0 for lossless
+};
+
+// New encoder context for glyphs of up to max_pixels (0 for the largest possible)
+zi_encoder_ctx_t * zi_encoder_new(uint32_t max_pixels) {
+	if(!max_pixels) max_pixels = 255u * 255u;
+	zi_encoder_ctx_t *ec = calloc(1, sizeof(zi_encoder_ctx_t));
+	if(!ec) return NULL;
+	ec->max_n = max_pixels;
+	ec->unpacked = malloc(max_pixels);
+	ec->out = malloc((size_t)max_pixels + 1);
+	if(!ec->unpacked || !ec->out || dp_alloc(&ec->dp, max_pixels)) {
+		zi_encoder_free(ec);
+		return NULL;
+	}
+	return ec;
+}
+
+void zi_encoder_free(zi_encoder_ctx_t *ec) {
+	if(!ec) return;
+	free(ec->dp.block);
+	free(ec->unpacked);
+	free(ec->out);
+	free(ec->check);
+	free(ec);
+}
+
+// Allow pixels to move up to max_err from source where that shortens anti-aliased streams
+void zi_encoder_set_max_err(zi_encoder_ctx_t *ec, uint8_t max_err) {
+	ec->max_err = max_err;
+}
+
+// Encode glyph, *out points into ec and stays valid until the next call
+int zi_encode_glyph(zi_encoder_ctx_t *ec, const zi_glyph_t *g, uint8_t height, uint8_t level, const uint8_t **out, uint32_t *len) {
+	uint32_t n = (uint32_t)g->w * height;
+	const uint8_t *src = g->data;
+	if(!level) level = ZI_LEVEL_BEST;
+	if(n > ec->max_n) return -1;
+
+	if(n == 0) { // empty glyph
+		ec->out[0] = 0x01;
+		*len = 1;
+	} else {
+		if(g->bpp != ZI_BPP8) {
+			zi_glyph_unpack(g, height, ec->unpacked);
+			src = ec->unpacked;
+		}
+		if(zi_is_binary(src, n)) {
+			*len = encode_glyph_bw(&ec->dp, src, n, level, ec->out);
+		} else if(ec->max_err) {
+			*len = encode_glyph_rd(&ec->dp, src, n, ec->max_err, ec->out);
+		} else {
+			*len = encode_glyph_aa(&ec->dp, src, n, level, ec->out);
+		}
+	}
+	*out = ec->out;
+	return 0;
+}
+
+// Crop rect must fit its cell
+static int view_check(const zi_glyph_view_t *v, uint8_t height) {
+	return (uint32_t)v->x + v->cw <= v->w && (uint32_t)v->y + v->ch <= height ? 0 : -1;
+}
+
+// Expand view to w*height 8-bit pixels, padding is transparent
+static void view_render(const zi_glyph_view_t *v, uint8_t height, uint8_t *out) {
+	for(uint32_t y = 0; y < height; y++, out += v->w) {
+		if(y < v->y || y >= (uint32_t)v->y + v->ch) {
+			memset(out, 0, v->w);
+			continue;
+		}
+		memset(out, 0, v->x);
+		memcpy(out + v->x, v->data + (size_t)(y - v->y) * v->stride, v->cw);
+		memset(out + v->x + v->cw, 0, v->w - v->x - v->cw);
+	}
+}
+
+// Encode glyph view, pixels are read from the source image into ec scratch only
+int zi_encode_view(zi_encoder_ctx_t *ec, const zi_glyph_view_t *v, uint8_t height, uint8_t level, const uint8_t **out, uint32_t *len) {
+	if(view_check(v, height) || (uint32_t)v->w * height > ec->max_n) return -1;
+	view_render(v, height, ec->unpacked);
+	zi_glyph_t g = { v->c, v->w, ec->unpacked, ZI_BPP8 };
+	return zi_encode_glyph(ec, &g, height, level, out, len);
+}
+
+// Count pixels of stream off their nearest level and the largest error against source
+static int rd_measure(zi_encoder_ctx_t *ec, const zi_glyph_t *g, uint8_t height, const uint8_t *stream, uint32_t len, uint32_t *pixels, uint8_t *max_err) {
+	uint32_t n = (uint32_t)g->w * height;
+	const uint8_t *src = g->data;
+	if(!n) return 0;
+	if(n > ec->max_n) return -1;
+	if(!ec->check && !(ec->check = malloc(ec->max_n))) return -1;
+	if(g->bpp != ZI_BPP8) {
+		zi_glyph_unpack(g, height, ec->unpacked);
+		src = ec->unpacked;
+	}
+	decode_glyph(stream + 1, len - 1, stream[0], g->w, height, ec->check);
+	for(uint32_t i = 0; i < n; i++) {
+		uint8_t v = src[i], d = ec->check[i];
+		if(d == a3_to_a8(q3(v))) continue;
+		uint8_t e = d > v ? d - v : v - d;
+		(*pixels)++;
+		if(e > *max_err) *max_err = e;
+	}
+	return 0;
+}
+
+static inline uint32_t align_up(uint32_t v, uint32_t a) {
+	return (v + (a - 1)) & ~(a - 1);
+}
+
+typedef struct {
+	uint32_t code;
+	uint8_t width;
+	uint32_t start;  // start offset from START OF CHARMAP (in bytes) divided by 8 if big file
+	uint16_t len;    // glyph data length in bytes
+	uint8_t *bytes;  // encoded glyph stream (starts with 0x03)
+	uint32_t same;   // glyph whose stream holds this one, own index if unique
+	uint8_t nested;  // stream is a prefix of a longer one
+} enc_glyph_t;
+
+static uint64_t fnv1a(const uint8_t *p, uint32_t len) {
+	uint64_t h = 0xCBF29CE484222325ull;
+	for(uint32_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001B3ull;
+	return h;
+}
+
+// Point glyphs with byte-identical streams at the first copy, returns number shared
+static uint32_t share_streams(enc_glyph_t *gi, uint32_t count) {
+	uint32_t size = 16;
+	while(size < count * 2) size <<= 1;
+	uint32_t *slot = malloc(size * sizeof(uint32_t)); // glyph index + 1, 0 if empty
+	uint64_t *hash = malloc(size * sizeof(uint64_t));
+	if(!slot || !hash) { // not sharing is always valid
+		free(slot);
+		free(hash);
+		return 0;
+	}
+	memset(slot, 0, size * sizeof(uint32_t));
+
+	uint32_t shared = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		uint64_t h = fnv1a(gi[i].bytes, gi[i].len);
+		uint32_t k = (uint32_t)h & (size - 1);
+		for(; slot[k]; k = (k + 1) & (size - 1)) {
+			const enc_glyph_t *o = &gi[slot[k] - 1];
+			if(hash[k] == h && o->len == gi[i].len && !memcmp(o->bytes, gi[i].bytes, o->len)) break;
+		}
+		if(slot[k]) {
+			gi[i].same = slot[k] - 1;
+			shared++;
+		} else {
+			slot[k] = i + 1;
+			hash[k] = h;
 		}
 	}
+	free(slot);
+	free(hash);
+	return shared;
+}
 
-	free(step);
-	free(a);
-	*out = o.buf;
-	*out_len = o.len;
-	return 0;
+static int cmp_stream(const void *a, const void *b) {
+	const enc_glyph_t *x = *(const enc_glyph_t * const *)a, *y = *(const enc_glyph_t * const *)b;
+	int c = memcmp(x->bytes, y->bytes, x->len < y->len ? x->len : y->len);
+	if(c) return c;
+	if(x->len != y->len) return x->len < y->len ? -1 : 1;
+	return (x > y) - (x < y);
 }
 
-// Decide if glyph is binary (only near 0 or near 255)
-static int is_binary_glyph(const uint8_t *src, uint32_t count) {
+// Streams that are a prefix of a longer stream start where it does, the
+// decoder reads only len bytes. Sorted, anything that is a prefix of some
+// stream is a prefix of the one right after it
+static uint32_t share_prefixes(enc_glyph_t *gi, uint32_t count) {
+	uint32_t m = 0, nested = 0;
+	enc_glyph_t **ord = malloc((count ? count : 1) * sizeof(enc_glyph_t *));
+	if(!ord) return 0; // not sharing is always valid
 	for(uint32_t i = 0; i < count; i++) {
-		uint8_t v = src[i];
-		if(!(v <= 3 || v >= 252)) return 0;
+		if(gi[i].same == i) ord[m++] = &gi[i];
 	}
-	return 1;
+	qsort(ord, m, sizeof(enc_glyph_t *), cmp_stream);
+
+	for(uint32_t k = m - (m ? 1 : 0); k-- > 0; ) {
+		enc_glyph_t *b = ord[k], *a = ord[k + 1];
+		if(b->len < a->len && !memcmp(b->bytes, a->bytes, b->len)) {
+			b->same = a->same; // a is a root or already nested in one
+			b->nested = 1;
+			nested++;
+		}
+	}
+	for(uint32_t i = 0; i < count; i++) gi[i].same = gi[gi[i].same].same;
+	free(ord);
+	return nested;
 }
 
-// 1-BIT ENCODER
+// Bump allocator for encoded streams, freed all at once
+typedef struct arena_blk {
+	struct arena_blk *next;
+	size_t used, cap;
+	uint8_t data[];
+} arena_blk_t;
+
+#define ARENA_BLK 65536
+
+static uint8_t * arena_alloc(arena_blk_t **head, size_t len) {
+	arena_blk_t *b = *head;
+	if(!b || b->cap - b->used < len) {
+		size_t cap = len > ARENA_BLK ? len : ARENA_BLK;
+		b = malloc(sizeof(arena_blk_t) + cap);
+		if(!b) return NULL;
+		b->next = *head;
+		b->used = 0;
+		b->cap = cap;
+		*head = b;
+	}
+	uint8_t *p = b->data + b->used;
+	b->used += len;
+	return p;
+}
+
+static void arena_free(arena_blk_t *b) {
+	while(b) {
+		arena_blk_t *next = b->next;
+		free(b);
+		b = next;
+	}
+}
 
+// == ENCODE CACHE ==
+
+#define ZI_ENCODER_VERSION 2 // bump when encoder output changes for the same input
+
+static const uint8_t cache_magic[4] = { 'Z', 'I', 'C', 1 };
+
+// Cached stream, key is a 128-bit hash of encoder version, level, size and pixels
 typedef struct {
-	uint32_t cost;
-	uint8_t tag;
-	uint8_t p0;
-	uint8_t p1;
-} bwstep_t;
-
-static uint32_t runlen_bw(const uint32_t n, const uint8_t *arr, uint32_t start, uint32_t maxlen, uint8_t val) {
-	uint32_t j = start, lim = start + maxlen;
-	while(j < n && j < lim && arr[j] == val) j++;
-	return j - start;
-}
-
-static int encode_glyph_bw_dp(const uint8_t *src8, uint8_t w, uint8_t h, uint8_t **out, uint32_t *out_len) {
-	const uint32_t n = (uint32_t)w * h;
-	uint8_t *a = (uint8_t *)malloc(n);
-	if(!a) return -1;
-	for(uint32_t i = 0; i < n; i++) a[i] = (src8[i] >= 128) ? 1 : 0;
-	bwstep_t *step = (bwstep_t *)malloc((n + 1) * sizeof(bwstep_t));
-	if(!step) {
-		free(a);
-		return -1;
+	uint64_t k0, k1;
+	uint32_t off;   // stream bytes in data
+	uint16_t len;
+} cache_ent_t;
+
+struct zi_cache {
+	char *path;
+	pthread_mutex_t lock;
+	cache_ent_t *ents;
+	uint32_t count, cap;
+	uint32_t saved;      // entries already in file
+	uint8_t valid;       // file has cache header and whole records, new entries are appended
+	uint32_t *slots;     // entry index + 1, 0 if empty
+	uint32_t size;       // number of slots, power of 2
+	uint8_t *data;
+	size_t data_len, data_cap;
+};
+
+static void cache_key(const zi_glyph_t *g, uint8_t height, uint8_t level, uint8_t max_err, uint64_t *k0, uint64_t *k1) {
+	uint8_t hdr[6] = { ZI_ENCODER_VERSION, level, g->w, height, g->bpp, max_err };
+	size_t n = zi_glyph_size(g, height);
+	uint64_t a = 0xCBF29CE484222325ull, b = 0x9E3779B97F4A7C15ull;
+	for(size_t i = 0; i < sizeof hdr + n; i++) {
+		uint8_t v = i < sizeof hdr ? hdr[i] : g->data[i - sizeof hdr];
+		a = (a ^ v) * 0x100000001B3ull;
+		b = (b ^ v) * 0xFF51AFD7ED558CCDull;
+		b ^= b >> 29;
 	}
-	for(uint32_t i = 0; i <= n; i++) step[i].cost = UINT32_MAX;
-	step[n].cost = 0;
-	step[n].tag = 0xFF;
-	for(int32_t i = (int32_t)n - 1; i >= 0; --i) {
-		uint32_t best = UINT32_MAX;
-		uint8_t tag = 0, p0 = 0, p1 = 0;
+	*k0 = a;
+	*k1 = b;
+}
 
-		// 00 b xxxxx: run of val (0 or 1), len 1..31
-		{
-			uint8_t val = a[i];
-			uint32_t rl = runlen_bw(n, a, (uint32_t)i, 31, val);
-			for(uint32_t L = 1; L <= rl; ++L) {
-				uint32_t cand = 1 + step[i + L].cost;
-				if(cand < best) {
-					best = cand;
-					tag = 0;
-					p0 = val;
-					p1 = (uint8_t)L;
-				}
-			}
+static int32_t cache_find(const zi_cache_t *c, uint64_t k0, uint64_t k1) {
+	for(uint32_t k = (uint32_t)k0 & (c->size - 1); c->slots[k]; k = (k + 1) & (c->size - 1)) {
+		const cache_ent_t *e = &c->ents[c->slots[k] - 1];
+		if(e->k0 == k0 && e->k1 == k1) return (int32_t)(c->slots[k] - 1);
+	}
+	return -1;
+}
+
+static int cache_add(zi_cache_t *c, uint64_t k0, uint64_t k1, const uint8_t *bytes, uint16_t len) {
+	if(c->count * 2 >= c->size) { // grow and rehash
+		uint32_t size = c->size ? c->size * 2 : 1024;
+		uint32_t *slots = calloc(size, sizeof(uint32_t));
+		if(!slots) return -1;
+		for(uint32_t i = 0; i < c->count; i++) {
+			uint32_t k = (uint32_t)c->ents[i].k0 & (size - 1);
+			while(slots[k]) k = (k + 1) & (size - 1);
+			slots[k] = i + 1;
 		}
+		free(c->slots);
+		c->slots = slots;
+		c->size = size;
+	}
+	if(c->count == c->cap) {
+		uint32_t cap = c->cap ? c->cap * 2 : 512;
+		cache_ent_t *ents = realloc(c->ents, cap * sizeof(cache_ent_t));
+		if(!ents) return -1;
+		c->ents = ents;
+		c->cap = cap;
+	}
+	if(c->data_len + len > c->data_cap) {
+		size_t cap = c->data_cap ? c->data_cap * 2 : 65536;
+		while(cap < c->data_len + len) cap *= 2;
+		uint8_t *data = realloc(c->data, cap);
+		if(!data) return -1;
+		c->data = data;
+		c->data_cap = cap;
+	}
+	memcpy(c->data + c->data_len, bytes, len);
+	c->ents[c->count] = (cache_ent_t){ k0, k1, (uint32_t)c->data_len, len };
+	c->data_len += len;
+	uint32_t k = (uint32_t)k0 & (c->size - 1);
+	while(c->slots[k]) k = (k + 1) & (c->size - 1);
+	c->slots[k] = ++c->count;
+	return 0;
+}
 
-		// 01 b xxxxx: t trans (1..31) then 1 or 2 opaque
-		if(a[i] == 0) {
-			uint32_t t = runlen_bw(n, a, (uint32_t)i, 31, 0);
-			if(t >= 1) {
-				uint32_t j = (uint32_t)i + t;
-				if(j < n && a[j] == 1) {
-					uint32_t cand1 = 1 + step[j + 1].cost; // one opaque
-					if(cand1 < best) {
-						best = cand1;
-						tag = 1;
-						p0 = 0;
-						p1 = (uint8_t)t;
-					}
-					if(j + 1 < n && a[j + 1] == 1) {
-						uint32_t cand2 = 1 + step[j + 2].cost; // two opaque
-						if(cand2 < best) {
-							best = cand2;
-							tag = 1;
-							p0 = 1;
-							p1 = (uint8_t)t;
-						}
-					}
-				}
-			}
+// Open encode cache file, missing or empty file gives an empty cache.
+// NULL if the file is something else, it is never overwritten
+zi_cache_t * zi_cache_open(const char *path) {
+	zi_cache_t *c = calloc(1, sizeof(zi_cache_t));
+	if(!c) return NULL;
+	c->path = malloc(strlen(path) + 1);
+	if(!c->path) {
+		free(c);
+		return NULL;
+	}
+	strcpy(c->path, path);
+	pthread_mutex_init(&c->lock, NULL);
+
+	FILE *f = fopen(path, "rb");
+	if(!f) return c;
+	uint8_t hdr[4];
+	size_t got = fread(hdr, 1, 4, f);
+	if(got == 0 && feof(f)) { // empty file, written from scratch
+		fclose(f);
+		return c;
+	}
+	if(got != 4 || memcmp(hdr, cache_magic, 4)) {
+		fprintf(stderr, "%s: not a ZI encode cache\n", path);
+		fclose(f);
+		pthread_mutex_destroy(&c->lock);
+		free(c->path);
+		free(c);
+		return NULL;
+	}
+	uint8_t rec[18], buf[65536];
+	int torn = 0;
+	while((got = fread(rec, 1, 18, f)) == 18) {
+		uint64_t k0 = 0, k1 = 0;
+		for(int i = 7; i >= 0; i--) {
+			k0 = (k0 << 8) | rec[i];
+			k1 = (k1 << 8) | rec[8 + i];
+		}
+		uint16_t len = (uint16_t)rd_le16(rec + 16);
+		if(fread(buf, 1, len, f) != len) { // torn tail, dropped
+			torn = 1;
+			break;
 		}
+		if(c->size && cache_find(c, k0, k1) >= 0) continue;
+		if(cache_add(c, k0, k1, buf, len)) break;
+	}
+	if(got && got != 18) torn = 1;
+	fclose(f);
+	// appending after a partial record would misframe the rest, so a torn
+	// file is rewritten whole on close
+	c->valid = !torn;
+	c->saved = torn ? 0 : c->count;
+	return c;
+}
 
-		// 10 b xxxxx: t trans then 3 (b=0) or 4 (b=1) opaque
-		if(a[i] == 0) {
-			uint32_t t = runlen_bw(n, a, (uint32_t)i, 31, 0);
-			if(t <= 31) {
-				uint32_t j = (uint32_t)i + t;
-				// require 3 or 4 opaques available
-				if(j + 2 < n && a[j] == 1 && a[j + 1] == 1 && a[j + 2] == 1) {
-					uint32_t cand3 = 1 + step[j + 3].cost; // +3 opaque
-					if(cand3 < best) {
-						best = cand3;
-						tag = 2;
-						p0 = 0;
-						p1 = (uint8_t)t;
-					}
-					if(j + 3 < n && a[j + 3] == 1) {
-						uint32_t cand4 = 1 + step[j + 4].cost; // +4 opaque
-						if(cand4 < best) {
-							best = cand4;
-							tag = 2;
-							p0 = 1;
-							p1 = (uint8_t)t;
-						}
-					}
-				}
-			}
+// Write new entries, or the whole cache if the file was torn, and free it.
+// -1 if they could not be written
+int zi_cache_close(zi_cache_t *c) {
+	if(!c) return 0;
+	int r = 0;
+	if(c->saved != c->count) {
+		FILE *f = fopen(c->path, c->valid ? "ab" : "wb");
+		if(f && !c->valid) fwrite(cache_magic, 1, 4, f);
+		for(uint32_t i = c->saved; f && i < c->count; i++) {
+			const cache_ent_t *e = &c->ents[i];
+			uint8_t rec[18];
+			for(int b = 0; b < 8; b++) {
+				rec[b] = (uint8_t)(e->k0 >> (8 * b));
+				rec[8 + b] = (uint8_t)(e->k1 >> (8 * b));
 			}
+			rec[16] = (uint8_t)(e->len & 0xFF);
+			rec[17] = (uint8_t)(e->len >> 8);
+			fwrite(rec, 1, 18, f);
+			fwrite(c->data + e->off, 1, e->len, f);
+		}
+		if(!f || fclose(f)) {
+			perror(c->path);
+			r = -1;
+		}
+	}
+	pthread_mutex_destroy(&c->lock);
+	free(c->path);
+	free(c->ents);
+	free(c->slots);
+	free(c->data);
+	free(c);
+	return r;
+}
 
-			// 11 www bbb: www trans (0..7), then bbb opaque (0..7)
-			{
-				uint32_t t = runlen_bw(n, a, (uint32_t)i, 7, 0);
-				uint32_t o = runlen_bw(n, a, (uint32_t)i + t, 7, 1);
-				uint32_t adv = t + o;
-				if(adv > 0) {
-					uint32_t cand = 1 + step[i + adv].cost;
-					if(cand < best) {
-						best = cand;
-						tag = 3;
-						p0 = (uint8_t)t;
-						p1 = (uint8_t)o;
-					}
-				}
-			}
+// Per-worker encoder state
+typedef struct {
+	zi_encoder_ctx_t *ec;
+	arena_blk_t *arena;
+	uint32_t hits, misses;
+	uint32_t lossy_pixels;
+	uint8_t lossy_max_err;
+} enc_worker_t;
 
-			step[i].cost = best;
-			step[i].tag = tag;
-			step[i].p0 = p0;
-			step[i].p1 = p1;
-		}
+typedef struct {
+	const zi_font_t *font;
+	enc_glyph_t *gi;
+	uint8_t level;
+	uint8_t max_err;
+	uint32_t max_n;
+	zi_cache_t *cache;
+	enc_worker_t *workers;
+	const zi_glyph_view_t *views; // encode these instead of font->glyphs
+} enc_job_t;
+
+static void encode_one(void *ctx, uint32_t i, unsigned worker) {
+	enc_job_t *job = (enc_job_t *)ctx;
+	enc_worker_t *wk = &job->workers[worker];
+	const zi_glyph_t *g = job->views ? NULL : &job->font->glyphs[i];
+	zi_glyph_t vg;
+	zi_cache_t *cache = job->cache;
+	const uint8_t *enc;
+	uint32_t elen;
+	uint8_t *bytes = NULL;
+	uint64_t k0 = 0, k1 = 0;
+
+	if(job->views) { // render into scratch, from there on it is a plain glyph
+		const zi_glyph_view_t *v = &job->views[i];
+		if(!wk->ec && (wk->ec = zi_encoder_new(job->max_n))) zi_encoder_set_max_err(wk->ec, job->max_err);
+		if(!wk->ec) return;
+		view_render(v, job->font->height, wk->ec->unpacked);
+		vg = (zi_glyph_t){ v->c, v->w, wk->ec->unpacked, ZI_BPP8 };
+		g = &vg;
+	}
 
-		obuf_t o = { 0 };
-		if(o_put(&o, 0x01)) {
-			free(a);
-			free(step);
-			return -1;
+	if(cache) {
+		cache_key(g, job->font->height, job->level, job->max_err, &k0, &k1);
+		pthread_mutex_lock(&cache->lock);
+		int32_t e = cache->size ? cache_find(cache, k0, k1) : -1;
+		if(e >= 0) {
+			elen = cache->ents[e].len;
+			bytes = arena_alloc(&wk->arena, elen);
+			if(bytes) memcpy(bytes, cache->data + cache->ents[e].off, elen);
 		}
+		pthread_mutex_unlock(&cache->lock);
+		if(e >= 0 && !bytes) return;
+	}
 
-		uint32_t i = 0;
-		while(i < n) {
-		uint8_t tag = step[i].tag, A = step[i].p0, B = step[i].p1;
-		uint8_t b;
-		if(tag == 0) { // 00 b xxxxx
-			b = (0u << 6) | ((A & 1) << 5) | (B & 31);
-			i += B;
-		} else if(tag == 1) { // 01 b xxxxx
-			b = (1u << 6) | ((A & 1) << 5) | (B & 31);
-			i += B + 1 + (A ? 1 : 0);
-		} else if(tag == 2) { // 10 b xxxxx
-			b = (2u << 6) | ((A & 1) << 5) | (B & 31);
-			i += B + (A ? 4 : 3);
-		} else { // 11 www bbb
-			b = (3u << 6) | ((A & 7) << 3) | (B & 7);
-			i += A + B;
-		}
-		if(o_put(&o, b)) {
-			free(a);
-			free(step);
-			free(o.buf);
-			return -1;
+	if(!bytes || job->max_err) {
+		if(!wk->ec && (wk->ec = zi_encoder_new(job->max_n))) zi_encoder_set_max_err(wk->ec, job->max_err);
+		if(!wk->ec) return;
+	}
+	if(bytes) {
+		wk->hits++;
+	} else {
+		if(zi_encode_glyph(wk->ec, g, job->font->height, job->level, &enc, &elen)) return;
+		bytes = arena_alloc(&wk->arena, elen);
+		if(!bytes) return;
+		memcpy(bytes, enc, elen);
+		if(cache) {
+			wk->misses++;
+			pthread_mutex_lock(&cache->lock);
+			cache_add(cache, k0, k1, bytes, (uint16_t)elen); // a failed add only costs a re-encode
+			pthread_mutex_unlock(&cache->lock);
 		}
 	}
 
-	free(step);
-	free(a);
-	*out = o.buf;
-	*out_len = o.len;
-	return 0;
-}
+	if(job->max_err && rd_measure(wk->ec, g, job->font->height, bytes, elen, &wk->lossy_pixels, &wk->lossy_max_err)) return;
 
-static inline uint32_t align_up(uint32_t v, uint32_t a) {
-	return (v + (a - 1)) & ~(a - 1);
+	job->gi[i].code = g->c;
+	job->gi[i].width = g->w;
+	job->gi[i].bytes = bytes;
+	job->gi[i].len = (uint16_t)elen;
+	job->gi[i].same = i;
 }
 
-// Make ZI font
-void zi_make_utf8(const char *file_name, const zi_font_t *font) {
-	const char *font_name = font->font_name;
-	uint8_t height = font->height;
-	uint32_t glyph_count = font->glyph_count;
-	zi_glyph_t *glyphs = font->glyphs;
-		
-	typedef struct {
-	uint32_t code;
-	uint8_t width;
-	uint32_t start; // start offset from START OF CHARMAP (in bytes) divided by 8 if big file
-	uint16_t len;		// glyph data length in bytes
-	uint8_t *bytes;		// encoded glyph stream (starts with 0x03)
-	} GI;
-
-	FILE *f = fopen(file_name, "wb");
-		if(!f) {
-		perror(file_name);
-		return;
+// Sum per-worker counters into stats
+static void encode_stats(const enc_worker_t *workers, unsigned threads, zi_make_stats_t *stats) {
+	if(!stats) return;
+	for(unsigned t = 0; t < threads; t++) {
+		stats->cache_hits += workers[t].hits;
+		stats->cache_misses += workers[t].misses;
+		stats->lossy_pixels += workers[t].lossy_pixels;
+		if(workers[t].lossy_max_err > stats->lossy_max_err) stats->lossy_max_err = workers[t].lossy_max_err;
 	}
+}
 
-	// Encode glyphs
-	GI *gi = (GI *)calloc(glyph_count, sizeof(GI));
-	if(!gi) {
-		fclose(f);
-		return;
+static void encode_done(enc_worker_t *workers, unsigned threads) {
+	for(unsigned t = 0; t < threads; t++) {
+		zi_encoder_free(workers[t].ec);
+		arena_free(workers[t].arena);
 	}
-	uint32_t total_glyph_bytes = 0;
+	free(workers);
+}
+
+// File layout of encoded glyphs
+typedef struct {
+	uint8_t align8;      // offsets in charmap are divided by 8
+	uint32_t cmap_off;   // file offset where charmap begins
+	uint32_t base;       // first glyph start, bytes from charmap start
+	uint32_t total_len;  // bytes after the 0x2C byte header
+} zi_layout_t;
+
+// Place glyphs with gi[].same already set and fill stats
+static void layout_zi(const char *font_name, enc_glyph_t *gi, uint32_t glyph_count, const zi_make_opts_t *opts, zi_layout_t *lo) {
+	uint32_t total_glyph_bytes = 0, shared = 0, shared_bytes = 0, pad = 0, pad_saved = 0;
 	for(uint32_t i = 0; i < glyph_count; i++) {
-		uint8_t *src = glyphs[i].data;
-		uint8_t w = glyphs[i].w;
-		uint8_t h = height;
-
-		uint8_t *enc = NULL;
-		uint32_t elen = 0;
-		uint32_t n = (uint32_t)w * h;
-
-		if(n == 0) {
-			enc = malloc(1);
-			enc[0] = 0x01;
-			elen = 1;	// empty glyph
-		} else if(is_binary_glyph(src, n)) {
-			encode_glyph_bw_dp(src, w, h, &enc, &elen);
+		uint32_t tail = (8u - (gi[i].len & 7u)) & 7u;
+		if(gi[i].same == i) {
+			total_glyph_bytes += gi[i].len;
+			pad += tail;
 		} else {
-			encode_glyph_aa_dp(src, w, h, &enc, &elen);
+			shared++;
+			shared_bytes += gi[i].len;
+			if(gi[i].nested) pad_saved += tail;
 		}
-
-		gi[i].code = glyphs[i].c;
-		gi[i].width = w;
-		gi[i].bytes = enc;
-		gi[i].len = (uint16_t)elen;
-
-		total_glyph_bytes += gi[i].len;
 	}
 
 	bool align8 = (total_glyph_bytes > 0xFFFFFFu);
@@ -595,19 +2148,42 @@ void zi_make_utf8(const char *file_name, const zi_font_t *font) {
 	uint32_t cmap_off = 0x2C + desc_len;						 // file offset where charmap begins
 	uint32_t base_from_cmap = align_up(10u * glyph_count, align8 ? 8u : 1u); // first glyph start (bytes from charmap start)
 
-	// Compute start for each glyph
+	// Compute start for each glyph, shared streams may live in a later glyph
 	uint32_t cur_from_cmap = base_from_cmap;
 	for(uint32_t i = 0; i < glyph_count; i++) {
+		if(gi[i].same != i) continue;
 		gi[i].start = cur_from_cmap / (align8 ? 8u : 1u);
 		cur_from_cmap += gi[i].len;
 		cur_from_cmap = align_up(cur_from_cmap, align8 ? 8u : 1u);
 	}
+	for(uint32_t i = 0; i < glyph_count; i++) gi[i].start = gi[gi[i].same].start;
 	uint32_t glyph_bytes_total = cur_from_cmap - base_from_cmap;
 
-	// Make the header
-	uint32_t total_len = (uint32_t)desc_len + 10u * glyph_count + glyph_bytes_total;
+	lo->align8 = align8;
+	lo->cmap_off = cmap_off;
+	lo->base = base_from_cmap;
+	lo->total_len = (uint32_t)desc_len + 10u * glyph_count + glyph_bytes_total;
+
+	if(opts && opts->stats) {
+		opts->stats->glyph_bytes = total_glyph_bytes;
+		opts->stats->file_bytes = 0x2Cu + lo->total_len;
+		opts->stats->shared_glyphs = shared;
+		opts->stats->shared_bytes = shared_bytes;
+		opts->stats->pad_bytes = align8 ? pad : 0;
+		opts->stats->pad_saved = align8 ? pad_saved : 0;
+		opts->stats->cache_hits = 0;
+		opts->stats->cache_misses = 0;
+		opts->stats->lossy_pixels = 0;
+		opts->stats->lossy_max_err = 0;
+		opts->stats->best_bytes = 0;
+		opts->stats->exact_bytes = 0;
+	}
+}
 
-	uint8_t H[0x2C] = { 0 };
+// Header, description and charmap into zeroed buf of at least cmap_off + 10 * glyph_count bytes
+static void put_head(uint8_t *buf, const char *font_name, uint8_t height, const enc_glyph_t *gi, uint32_t glyph_count, const zi_layout_t *lo) {
+	uint8_t desc_len = (uint8_t)strlen(font_name);
+	uint8_t *H = buf;
 	H[0x00] = 0x04; // signature
 	H[0x01] = 0xFF; // ? 
 	H[0x03] = 0x0A; // orientation (typical)
@@ -623,10 +2199,10 @@ void zi_make_utf8(const char *file_name, const zi_font_t *font) {
 	H[0x0F] = (uint8_t)((glyph_count >> 24) & 0xFF);
 	H[0x10] = 6;		// version
 	H[0x11] = desc_len; // description length (no NUL)
-	H[0x14] = (uint8_t)(total_len & 0xFF);
-	H[0x15] = (uint8_t)((total_len >> 8) & 0xFF);
-	H[0x16] = (uint8_t)((total_len >> 16) & 0xFF);
-	H[0x17] = (uint8_t)((total_len >> 24) & 0xFF);
+	H[0x14] = (uint8_t)(lo->total_len & 0xFF);
+	H[0x15] = (uint8_t)((lo->total_len >> 8) & 0xFF);
+	H[0x16] = (uint8_t)((lo->total_len >> 16) & 0xFF);
+	H[0x17] = (uint8_t)((lo->total_len >> 24) & 0xFF);
 	H[0x18] = 0x2C; // data_addr -> start of description
 	H[0x1C] = 0xFF; // ?
 	H[0x1E] = 0x01; // ?
@@ -636,18 +2212,17 @@ void zi_make_utf8(const char *file_name, const zi_font_t *font) {
 	} else {
 		H[0x20] = desc_len; // description shown
 	}
-	H[0x21] = align8 ? 0x01 : 0x00;			// offsets are divided by 8 or not
+	H[0x21] = lo->align8 ? 0x01 : 0x00;			// offsets are divided by 8 or not
 	H[0x24] = (uint8_t)(glyph_count & 0xFF); // subset_actual
 	H[0x25] = (uint8_t)((glyph_count >> 8) & 0xFF);
 	H[0x26] = (uint8_t)((glyph_count >> 16) & 0xFF);
 	H[0x27] = (uint8_t)((glyph_count >> 24) & 0xFF);
 
-	fwrite(H, 1, sizeof H, f);
-	fwrite(font_name, 1, desc_len, f);
+	memcpy(buf + 0x2C, font_name, desc_len);
 
 	// Char map entries (10 bytes each)
 	for(uint32_t i = 0; i < glyph_count; i++) {
-		uint8_t E[10] = { 0 };
+		uint8_t *E = buf + lo->cmap_off + 10u * i;
 		// codepoint is 16-bit in map
 		E[0] = (uint8_t)(gi[i].code & 0xFF);
 		E[1] = (uint8_t)((gi[i].code >> 8) & 0xFF);
@@ -661,33 +2236,596 @@ void zi_make_utf8(const char *file_name, const zi_font_t *font) {
 		// length
 		E[8] = (uint8_t)(gi[i].len & 0xFF);
 		E[9] = (uint8_t)((gi[i].len >> 8) & 0xFF);
-		fwrite(E, 1, 10, f);
 	}
+}
+
+// Lay out encoded glyphs into a ZI file image and fill stats. Returns the
+// malloc'd image of *size bytes, or NULL when want is 0 or out of memory
+static uint8_t * build_zi(const char *font_name, uint8_t height, enc_glyph_t *gi, uint32_t glyph_count, const zi_make_opts_t *opts, int want, size_t *size) {
+	zi_layout_t lo;
+
+	// Glyphs with identical streams share one copy, as do prefixes of longer streams
+	if(!(opts && opts->keep_dups)) {
+		share_streams(gi, glyph_count);
+		share_prefixes(gi, glyph_count);
+	}
+	layout_zi(font_name, gi, glyph_count, opts, &lo);
+	*size = 0x2Cu + lo.total_len;
+	if(!want) return NULL;
+
+	// Every offset is known, so fill one zeroed image and leave padding as is
+	uint8_t *buf = calloc(*size, 1);
+	if(!buf) {
+		fprintf(stderr, "Out of memory for %zu byte font\n", *size);
+		return NULL;
+	}
+	put_head(buf, font_name, height, gi, glyph_count, &lo);
+
+	// Glyph streams at their (possibly aligned) starts
+	for(uint32_t i = 0; i < glyph_count; i++) {
+		if(gi[i].same != i) continue; // written with first copy
+		memcpy(buf + lo.cmap_off + (size_t)gi[i].start * (lo.align8 ? 8u : 1u), gi[i].bytes, gi[i].len);
+	}
+	return buf;
+}
+
+static pthread_mutex_t tmp_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t tmp_seq;
+
+// Create <path>.<pid>.<seq>.<ext> for writing (and reading if rw), unique so
+// concurrent builds of one target never share a temp file. *tmp_path is malloc'd
+static FILE * open_tmp(const char *path, const char *ext, int rw, char **tmp_path) {
+	*tmp_path = malloc(strlen(path) + strlen(ext) + 32);
+	if(!*tmp_path) return NULL;
+	pthread_mutex_lock(&tmp_lock);
+	uint32_t seq = tmp_seq++;
+	pthread_mutex_unlock(&tmp_lock);
+#ifdef _WIN32
+	sprintf(*tmp_path, "%s.%lu.%u.%s", path, (unsigned long)GetCurrentProcessId(), seq, ext);
+	FILE *f = fopen(*tmp_path, rw ? "w+b" : "wb");
+#else
+	sprintf(*tmp_path, "%s.%lu.%u.%s", path, (unsigned long)getpid(), seq, ext);
+	int fd = open(*tmp_path, (rw ? O_RDWR : O_WRONLY) | O_CREAT | O_EXCL, 0666);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, rw ? "w+b" : "wb");
+	if(fd >= 0 && !f) {
+		close(fd);
+		remove(*tmp_path);
+	}
+#endif
+	if(!f) {
+		perror(*tmp_path);
+		free(*tmp_path);
+		*tmp_path = NULL;
+	}
+	return f;
+}
+
+// Close temp file and rename it over path, or remove it if ok is 0 or anything failed
+static int commit_tmp(FILE *f, char *tmp_path, const char *path, int ok) {
+	if(fclose(f) || !ok) {
+		if(ok) perror(tmp_path);
+		remove(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+#ifdef _WIN32
+	if(!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+		fprintf(stderr, "%s: rename failed (%lu)\n", path, (unsigned long)GetLastError());
+#else
+	if(rename(tmp_path, path)) {
+		perror(path);
+#endif
+		remove(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+	free(tmp_path);
+	return 0;
+}
 
-	// Pad from end-of-charmap up to the first glyph start (if needed)
-	long cur = ftell(f);
-	long want = (long)cmap_off + (long)base_from_cmap;
-	while(cur < want) {
-		static const uint8_t z[8] = { 0 };
-		size_t chunk = (size_t)((want - cur) > 8 ? 8 : (want - cur));
-		fwrite(z, 1, chunk, f);
-		cur += (long)chunk;
+// Write file in one go beside path and rename over it, readers never see a partial file
+static int write_atomic(const char *path, const uint8_t *buf, size_t size) {
+	char *tmp_path;
+	FILE *f = open_tmp(path, "tmp", 0, &tmp_path);
+	if(!f) return -1;
+	int ok = fwrite(buf, 1, size, f) == size;
+	if(!ok) perror(tmp_path);
+	return commit_tmp(f, tmp_path, path, ok);
+}
+
+// Make ZI font, 0 or -1 if it could not be made or written
+int zi_make_utf8(const char *file_name, const zi_font_t *font) {
+	return zi_make_utf8_ex(file_name, font, NULL);
+}
+
+// Encode font and build its file image, NULL when want is 0 or on failure
+static uint8_t * make_zi_once(const zi_font_t *font, const zi_glyph_view_t *views, const zi_make_opts_t *opts, int want, size_t *size) {
+	uint8_t level = (opts && opts->level) ? opts->level : ZI_LEVEL_BEST;
+	unsigned threads = (opts && opts->threads) ? opts->threads : 1;
+	uint32_t glyph_count = font->glyph_count;
+	uint8_t *buf = NULL;
+	*size = 0;
+
+	// Encode glyphs, streams are independent and land in their own slot
+	enc_glyph_t *gi = (enc_glyph_t *)calloc(glyph_count ? glyph_count : 1, sizeof(enc_glyph_t));
+	enc_worker_t *workers = (enc_worker_t *)calloc(threads, sizeof(enc_worker_t));
+	if(!gi || !workers) {
+		free(gi);
+		free(workers);
+		return NULL;
+	}
+	uint32_t max_n = 1; // scratch is sized for the largest glyph
+	for(uint32_t i = 0; i < glyph_count; i++) {
+		uint32_t n = (uint32_t)(views ? views[i].w : font->glyphs[i].w) * font->height;
+		if(n > max_n) max_n = n;
+		if(views && view_check(&views[i], font->height)) {
+			fprintf(stderr, "Glyph U+%04X crop rect outside its cell\n", views[i].c);
+			free(gi);
+			free(workers);
+			return NULL;
+		}
 	}
+	enc_job_t job = { font, gi, level, opts ? opts->max_err : 0, max_n, opts ? opts->cache : NULL, workers, views };
+	run_parallel(glyph_count, threads, encode_one, &job);
 
-	// Write glyph streams (optionally with padding) between them
 	for(uint32_t i = 0; i < glyph_count; i++) {
-		// ensure current file pos == cmap_off + (gi[i].start * 8)
-		long need = (long)cmap_off + (long)(gi[i].start * (align8 ? 8u : 1u));
-		cur = ftell(f);
-		while(cur < need) {
-			uint8_t z = 0;
-			fwrite(&z, 1, 1, f);
-			cur++;
+		if(!gi[i].bytes) {
+			fprintf(stderr, "Out of memory encoding glyph U+%04X\n", views ? views[i].c : font->glyphs[i].c);
+			encode_done(workers, threads);
+			free(gi);
+			return NULL;
 		}
-		fwrite(gi[i].bytes, 1, gi[i].len, f);
 	}
 
-	fclose(f);
-	for(uint32_t i = 0; i < glyph_count; i++) free(gi[i].bytes);
+	buf = build_zi(font->font_name, font->height, gi, glyph_count, opts, want, size);
+	if(opts) encode_stats(workers, threads, opts->stats);
+	encode_done(workers, threads);
+	free(gi);
+	return buf;
+}
+
+// File size of font made with o, 0 if it failed. Sizing leaves the cache alone
+static uint32_t make_size(const zi_font_t *font, const zi_glyph_view_t *views, zi_make_opts_t o) {
+	zi_make_stats_t s = { 0 };
+	size_t size;
+	o.cache = NULL;
+	o.stats = &s;
+	make_zi_once(font, views, &o, 0, &size);
+	return s.file_bytes;
+}
+
+// Make font, then size the optimal and lossless encodings if stats want them
+static uint8_t * make_zi(const zi_font_t *font, const zi_glyph_view_t *views, const zi_make_opts_t *opts, int want, size_t *size) {
+	uint8_t *buf = make_zi_once(font, views, opts, want, size);
+	zi_make_stats_t *st = opts ? opts->stats : NULL;
+	if(st && st->file_bytes && opts->level && opts->level != ZI_LEVEL_BEST) {
+		zi_make_opts_t o = *opts;
+		o.level = ZI_LEVEL_BEST;
+		st->best_bytes = make_size(font, views, o);
+	}
+	if(st && st->file_bytes && opts->max_err) {
+		zi_make_opts_t o = *opts;
+		o.max_err = 0;
+		st->exact_bytes = make_size(font, views, o);
+	}
+	return buf;
+}
+
+// Make ZI font with options (NULL for defaults), file_name may be NULL to only fill stats.
+// 0 or -1 if it could not be made or written
+int zi_make_utf8_ex(const char *file_name, const zi_font_t *font, const zi_make_opts_t *opts) {
+	size_t size;
+	uint8_t *buf = make_zi(font, NULL, opts, file_name != NULL, &size);
+	int r = file_name ? (buf ? write_atomic(file_name, buf, size) : -1) : (size ? 0 : -1);
+	free(buf);
+	return r;
+}
+
+// Make ZI font in memory, returns malloc'd file image of *size bytes or NULL
+uint8_t * zi_make_to_buffer(const zi_font_t *font, const zi_make_opts_t *opts, size_t *size) {
+	return make_zi(font, NULL, opts, 1, size);
+}
+
+// Make ZI font from glyph views, e.g. straight from a font atlas, as zi_make_utf8_ex
+int zi_make_utf8_views(const char *file_name, const char *font_name, uint8_t height, const zi_glyph_view_t *views, uint32_t count, const zi_make_opts_t *opts) {
+	zi_font_t f = { (char *)font_name, height, count, NULL, NULL, NULL };
+	size_t size;
+	uint8_t *buf = make_zi(&f, views, opts, file_name != NULL, &size);
+	int r = file_name ? (buf ? write_atomic(file_name, buf, size) : -1) : (size ? 0 : -1);
+	free(buf);
+	return r;
+}
+
+// Print opts->stats of a make call to stdout
+void zi_print_stats(const zi_make_opts_t *opts) {
+	const zi_make_stats_t *s = opts->stats;
+	if(!s) return;
+	if(s->shared_glyphs) printf("Shared streams: %u glyphs, %u bytes saved\n", s->shared_glyphs, s->shared_bytes);
+	if(s->pad_bytes || s->pad_saved) printf("Align8 padding: %u bytes, %u before layout\n", s->pad_bytes, s->pad_bytes + s->pad_saved);
+	if(opts->cache) printf("Encode cache: %u hits, %u misses\n", s->cache_hits, s->cache_misses);
+	if(s->best_bytes)
+		printf("Level %u vs best: %+ld bytes (%+.2f%%)\n", opts->level, (long)s->file_bytes - (long)s->best_bytes,
+			100.0 * ((double)s->file_bytes - (double)s->best_bytes) / (double)s->best_bytes);
+	if(s->exact_bytes)
+		printf("Lossy -e%u: %ld bytes saved, %u pixels changed, max error %u\n", opts->max_err,
+			(long)s->exact_bytes - (long)s->file_bytes, s->lossy_pixels, s->lossy_max_err);
+}
+
+// == STREAMING WRITER ==
+
+// Glyphs are encoded as they arrive and unique streams go to a spill file
+// beside the output, only the charmap stays in memory until close
+#define SPILL_MAX 0x7FFFFFFFu // spill offsets go to fseek as long, 32-bit on Windows
+
+struct zi_writer {
+	char *file_name;
+	char *font_name;
+	uint8_t height;
+	zi_make_opts_t opts;
+	enc_worker_t wk;
+	enc_glyph_t *gi;      // charmap so far, start is offset in spill until close
+	uint32_t count, cap;
+	uint64_t *hash;       // stream hash of each glyph
+	uint32_t *slots;      // first glyph with stream + 1, 0 if empty
+	uint32_t size;        // number of slots, power of 2
+	uint32_t unique;
+	FILE *spill;
+	char *spill_path;     // beside file_name (cwd if only sizing), removed on close
+	uint32_t spill_len;
+	uint8_t *cmp;         // stream read back from spill
+	uint8_t failed;
+};
+
+// New writer for file_name (NULL to only fill stats), opts as for zi_make_utf8_ex
+zi_writer_t * zi_writer_open(const char *file_name, const char *font_name, uint8_t height, const zi_make_opts_t *opts) {
+	zi_writer_t *w = calloc(1, sizeof(zi_writer_t));
+	if(!w) return NULL;
+	if(opts) w->opts = *opts;
+	if(!w->opts.level) w->opts.level = ZI_LEVEL_BEST;
+	w->height = height;
+	w->file_name = file_name ? malloc(strlen(file_name) + 1) : NULL;
+	w->font_name = malloc(strlen(font_name) + 1);
+	w->cmp = malloc(65536);
+	// not tmpfile(), which on Windows tries the drive root
+	w->spill = open_tmp(file_name ? file_name : "zi_writer", "spill", 1, &w->spill_path);
+	if((file_name && !w->file_name) || !w->font_name || !w->cmp || !w->spill) {
+		w->failed = 1;
+		zi_writer_close(w);
+		return NULL;
+	}
+	if(file_name) strcpy(w->file_name, file_name);
+	strcpy(w->font_name, font_name);
+	return w;
+}
+
+// Index of earlier glyph with the same stream, or -1
+static int32_t writer_find(zi_writer_t *w, uint64_t h, const uint8_t *bytes, uint16_t len) {
+	if(!w->size) return -1;
+	for(uint32_t k = (uint32_t)h & (w->size - 1); w->slots[k]; k = (k + 1) & (w->size - 1)) {
+		uint32_t j = w->slots[k] - 1;
+		if(w->hash[j] != h || w->gi[j].len != len) continue;
+		if(fseek(w->spill, (long)w->gi[j].start, SEEK_SET) || fread(w->cmp, 1, len, w->spill) != len) return -1;
+		if(!memcmp(w->cmp, bytes, len)) return (int32_t)j;
+	}
+	return -1;
+}
+
+static int writer_insert(zi_writer_t *w, uint32_t i) {
+	if((w->unique + 1) * 2 > w->size) {
+		uint32_t size = w->size ? w->size * 2 : 1024;
+		uint32_t *slots = calloc(size, sizeof(uint32_t));
+		if(!slots) return -1;
+		for(uint32_t j = 0; j < w->count; j++) {
+			if(w->gi[j].same != j || j == i) continue;
+			uint32_t k = (uint32_t)w->hash[j] & (size - 1);
+			while(slots[k]) k = (k + 1) & (size - 1);
+			slots[k] = j + 1;
+		}
+		free(w->slots);
+		w->slots = slots;
+		w->size = size;
+	}
+	uint32_t k = (uint32_t)w->hash[i] & (w->size - 1);
+	while(w->slots[k]) k = (k + 1) & (w->size - 1);
+	w->slots[k] = i + 1;
+	w->unique++;
+	return 0;
+}
+
+// Encode glyph and append it to the charmap, glyphs keep the order they are added in
+int zi_writer_add_glyph(zi_writer_t *w, const zi_glyph_t *g) {
+	if(w->failed) return -1;
+	if(w->count == w->cap) {
+		uint32_t cap = w->cap ? w->cap * 2 : 256;
+		enc_glyph_t *gi = realloc(w->gi, cap * sizeof(enc_glyph_t));
+		uint64_t *hash = gi ? realloc(w->hash, cap * sizeof(uint64_t)) : NULL;
+		if(gi) w->gi = gi;
+		if(hash) w->hash = hash;
+		if(!gi || !hash) {
+			w->failed = 1;
+			return -1;
+		}
+		w->cap = cap;
+	}
+
+	uint32_t i = w->count;
+	zi_font_t f = { w->font_name, w->height, 1, (zi_glyph_t *)g, NULL, NULL };
+	enc_glyph_t *e = &w->gi[i];
+	memset(e, 0, sizeof(enc_glyph_t));
+	enc_job_t job = { &f, e, w->opts.level, w->opts.max_err, 255u * w->height, w->opts.cache, &w->wk, NULL };
+	encode_one(&job, 0, 0);
+	if(!e->bytes) {
+		fprintf(stderr, "Out of memory encoding glyph U+%04X\n", g->c);
+		w->failed = 1;
+		return -1;
+	}
+
+	w->hash[i] = fnv1a(e->bytes, e->len);
+	int32_t j = w->opts.keep_dups ? -1 : writer_find(w, w->hash[i], e->bytes, e->len);
+	w->count++;
+	if(j >= 0) {
+		e->same = (uint32_t)j;
+	} else {
+		e->same = i;
+		e->start = w->spill_len;
+		if(e->len > SPILL_MAX - w->spill_len) {
+			fprintf(stderr, "%s: unique glyph streams exceed 2GB\n", w->file_name ? w->file_name : "spill");
+			w->failed = 1;
+		} else if(fseek(w->spill, 0, SEEK_END) || fwrite(e->bytes, 1, e->len, w->spill) != e->len ||
+		   (!w->opts.keep_dups && writer_insert(w, i))) {
+			perror("spill");
+			w->failed = 1;
+		}
+		w->spill_len += e->len;
+	}
+	e->bytes = NULL; // arena is reused for the next glyph
+	arena_free(w->wk.arena);
+	w->wk.arena = NULL;
+	return w->failed ? -1 : 0;
+}
+
+// Header and charmap, then unique streams copied from spill at their starts
+static int writer_flush(zi_writer_t *w, const zi_layout_t *lo) {
+	static const uint8_t zero[8] = { 0 };
+	size_t head = (size_t)lo->cmap_off + lo->base, pos = head;
+	char *tmp_path;
+	FILE *f = open_tmp(w->file_name, "tmp", 0, &tmp_path);
+	if(!f) return -1;
+	uint8_t *buf = calloc(head, 1);
+	int ok = buf != NULL && !fseek(w->spill, 0, SEEK_SET);
+	if(ok) {
+		put_head(buf, w->font_name, w->height, w->gi, w->count, lo);
+		ok = fwrite(buf, 1, head, f) == head;
+	}
+	for(uint32_t i = 0; ok && i < w->count; i++) {
+		if(w->gi[i].same != i) continue;
+		size_t at = lo->cmap_off + (size_t)w->gi[i].start * (lo->align8 ? 8u : 1u);
+		uint16_t len = w->gi[i].len;
+		ok = fwrite(zero, 1, at - pos, f) == at - pos &&
+		     fread(w->cmp, 1, len, w->spill) == len && fwrite(w->cmp, 1, len, f) == len;
+		pos = at + len;
+	}
+	if(ok) { // trailing alignment counted in header
+		size_t end = 0x2Cu + lo->total_len;
+		ok = fwrite(zero, 1, end - pos, f) == end - pos;
+	}
+	if(!ok) perror(tmp_path);
+	free(buf);
+	return commit_tmp(f, tmp_path, w->file_name, ok);
+}
+
+// Finish file and free writer, 0 on success
+int zi_writer_close(zi_writer_t *w) {
+	if(!w) return -1;
+	int result = -1;
+	if(!w->failed) {
+		zi_layout_t lo;
+		layout_zi(w->font_name, w->gi, w->count, &w->opts, &lo);
+		encode_stats(&w->wk, 1, w->opts.stats);
+		result = w->file_name ? writer_flush(w, &lo) : 0;
+	}
+	zi_encoder_free(w->wk.ec);
+	arena_free(w->wk.arena);
+	if(w->spill) fclose(w->spill);
+	if(w->spill_path) remove(w->spill_path);
+	free(w->spill_path);
+	free(w->file_name);
+	free(w->font_name);
+	free(w->gi);
+	free(w->hash);
+	free(w->slots);
+	free(w->cmp);
+	free(w);
+	return result;
+}
+
+// == ZI FONT PATCHING ==
+
+// Position of codepoint c in sorted patch order or -1
+static int32_t patch_find(const uint64_t *order, uint32_t count, uint32_t c) {
+	uint32_t lo = 0, hi = count;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) >> 1;
+		if((order[mid] >> 32) < c) lo = mid + 1;
+		else hi = mid;
+	}
+	return (lo < count && (order[lo] >> 32) == c) ? (int32_t)lo : -1;
+}
+
+// Replace or add glyphs in ZI file, untouched streams are copied as they are.
+// New codepoints are merged in codepoint order. Returns glyphs encoded or -1
+int zi_patch(const char *in_path, const char *out_path, const zi_glyph_t *glyphs, uint32_t count, const zi_make_opts_t *opts) {
+	zi_file_t *zf = zi_open(in_path);
+	if(!zf) return -1;
+	uint8_t level = (opts && opts->level) ? opts->level : ZI_LEVEL_BEST;
+	unsigned threads = (opts && opts->threads) ? opts->threads : 1;
+	int result = -1;
+
+	uint64_t *order = malloc((count ? count : 1) * sizeof(uint64_t));
+	uint8_t *used = calloc(count ? count : 1, 1);
+	enc_glyph_t *pg = calloc(count ? count : 1, sizeof(enc_glyph_t));
+	enc_glyph_t *gi = calloc((size_t)zf->glyph_count + count + 1, sizeof(enc_glyph_t));
+	enc_worker_t *workers = calloc(threads, sizeof(enc_worker_t));
+	uint8_t *buf = NULL;
+	size_t size;
+	if(!order || !used || !pg || !gi || !workers) goto done;
+
+	// Encode patch glyphs only
+	zi_font_t pf = { zf->font_name, zf->height, count, (zi_glyph_t *)glyphs, NULL, NULL };
+	uint32_t max_n = 1;
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t n = (uint32_t)glyphs[i].w * zf->height;
+		if(n > max_n) max_n = n;
+		order[i] = ((uint64_t)glyphs[i].c << 32) | i;
+	}
+	enc_job_t job = { &pf, pg, level, opts ? opts->max_err : 0, max_n, opts ? opts->cache : NULL, workers, NULL };
+	run_parallel(count, threads, encode_one, &job);
+	for(uint32_t i = 0; i < count; i++) {
+		if(!pg[i].bytes) {
+			fprintf(stderr, "Out of memory encoding glyph U+%04X\n", glyphs[i].c);
+			goto done;
+		}
+	}
+
+	// Latest patch glyph per codepoint, sorted
+	qsort(order, count, sizeof(uint64_t), cmp_u64);
+	uint32_t uniq = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		if(uniq && (order[uniq - 1] >> 32) == (order[i] >> 32)) uniq--;
+		order[uniq++] = order[i];
+	}
+
+	// Codepoints already in file are replaced in place, the rest are inserted
+	zi_entry_t ent;
+	for(uint32_t e = 0; e < zf->glyph_count; e++) {
+		int32_t k;
+		if(zi_file_entry(zf, e, &ent)) {
+			fprintf(stderr, "%s: glyph %u lies outside file\n", in_path, e);
+			goto done;
+		}
+		k = patch_find(order, uniq, ent.c);
+		if(k >= 0) used[k] = 1;
+	}
+
+	uint32_t n = 0, p = 0;
+	for(uint32_t e = 0; e < zf->glyph_count; e++) {
+		int32_t k;
+		zi_file_entry(zf, e, &ent);
+		for(; p < uniq && (order[p] >> 32) < ent.c; p++) {
+			if(!used[p]) gi[n++] = pg[(uint32_t)order[p]];
+			used[p] = 1;
+		}
+		k = patch_find(order, uniq, ent.c);
+		if(k >= 0) {
+			gi[n++] = pg[(uint32_t)order[k]];
+		} else {
+			gi[n].code = ent.c;
+			gi[n].width = ent.w;
+			gi[n].len = ent.len;
+			gi[n].bytes = (uint8_t *)ent.data; // read only, file stays mapped until written
+			n++;
+		}
+	}
+	for(; p < uniq; p++) {
+		if(!used[p]) gi[n++] = pg[(uint32_t)order[p]];
+	}
+	for(uint32_t i = 0; i < n; i++) gi[i].same = i;
+
+	// Copied streams point into the input, which may be the output, so
+	// build the image before letting go of it
+	buf = build_zi(zf->font_name, zf->height, gi, n, opts, 1, &size);
+	zi_close(zf);
+	zf = NULL;
+	if(!buf || write_atomic(out_path, buf, size)) goto done;
+	result = (int)uniq;
+	if(opts) encode_stats(workers, threads, opts->stats);
+
+done:
+	if(workers) encode_done(workers, threads);
+	free(order);
+	free(used);
+	free(pg);
 	free(gi);
+	free(buf);
+	zi_close(zf);
+	return result;
+}
+
+// == TOOL HELPERS ==
+
+// Load uncompressed 8-bit grayscale TGA (type 3), malloc'd w*h pixels or NULL
+uint8_t * zi_load_tga_gray(const char *path, int *w, int *h) {
+	FILE *f = fopen(path, "rb");
+	if(!f) {
+		perror(path);
+		return NULL;
+	}
+
+	uint8_t hdr[18];
+	if(fread(hdr, 1, 18, f) != 18) {
+		fclose(f);
+		return NULL;
+	}
+
+	if(hdr[2] != 3) { // type 3 = uncompressed grayscale
+		fprintf(stderr, "%s: not grayscale type 3 (found %u)\n", path, hdr[2]);
+		fclose(f);
+		return NULL;
+	}
+
+	*w = hdr[12] | (hdr[13] << 8);
+	*h = hdr[14] | (hdr[15] << 8);
+	if(hdr[16] != 8) {
+		fprintf(stderr, "%s: expected 8bpp, got %u\n", path, hdr[16]);
+		fclose(f);
+		return NULL;
+	}
+
+	size_t n = (size_t)(*w) * (*h);
+	uint8_t *buf = malloc(n ? n : 1);
+	if(!buf) {
+		fclose(f);
+		return NULL;
+	}
+
+	if(fread(buf, 1, n, f) != n) {
+		fprintf(stderr, "%s: truncated\n", path);
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+
+	fclose(f);
+	return buf;
+}
+
+// Take encoder option argv[*i] shared by the tools: -1|-2, and whichever of
+// -j<threads>, -e<max_err>, -k and -c <cache> has its letter in flags.
+// 1 if taken (*i moved past its argument), 0 if not one of them, -1 if the cache failed
+int zi_make_arg(int argc, char **argv, int *i, const char *flags, zi_make_opts_t *opts) {
+	const char *a = argv[*i];
+	if(a[0] != '-' || !a[1]) return 0;
+	if(a[1] >= '1' && a[1] <= '2' && !a[2]) {
+		opts->level = (uint8_t)(a[1] - '0');
+		return 1;
+	}
+	if(!strchr(flags, a[1])) return 0;
+	int v = atoi(a + 2);
+	if(a[1] == 'j' && v > 0) {
+		opts->threads = (unsigned)v;
+		return 1;
+	}
+	if(a[1] == 'e' && v > 0 && v <= 255) {
+		opts->max_err = (uint8_t)v;
+		return 1;
+	}
+	if(a[1] == 'k' && !a[2]) {
+		opts->keep_dups = 1;
+		return 1;
+	}
+	if(a[1] == 'c' && !a[2] && *i + 1 < argc && !opts->cache) {
+		opts->cache = zi_cache_open(argv[++*i]);
+		return opts->cache ? 1 : -1;
+	}
+	return 0;
 }
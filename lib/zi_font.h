@@ -1,21 +1,153 @@
 //  DS Prototyp 2025 D.W.Taylor [senseitg@gmail.com]
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define ZI_BPP8 0 // 8-bit grayscale, one byte per pixel
+#define ZI_BPP1 1 // mono, 8 pixels per byte, MSB first
+#define ZI_BPP4 4 // 3-bit alpha, 2 pixels per byte, high nibble first
+
 typedef struct {
   uint16_t c;     // unicode codepoint
   uint8_t w;      // width
-  uint8_t *data;  // grayscale pixels (height*w)
+  uint8_t *data;  // grayscale pixels (height*w), or packed per bpp
+  uint8_t bpp;    // pixel format of data, ZI_BPP8 unless loaded packed
 } zi_glyph_t;
 
+// Glyph read in place from a larger 8-bit image such as a font atlas.
+// The crop rect lands at x, y in a w*height cell, the rest is transparent
+typedef struct {
+  uint16_t c;           // unicode codepoint
+  uint8_t w;            // cell width
+  uint8_t x, y;         // placement of crop rect in cell
+  uint8_t cw, ch;       // crop rect size
+  uint32_t stride;      // bytes between rows of data
+  const uint8_t *data;  // top-left pixel of crop rect
+} zi_glyph_view_t;
+
+typedef struct zi_index zi_index_t;
+typedef struct zi_encoder_ctx zi_encoder_ctx_t;
+typedef struct zi_cache zi_cache_t;
+typedef struct zi_writer zi_writer_t;
+
 typedef struct {
 	char *font_name;      // description string from .zi header
 	uint8_t height;
 	uint32_t glyph_count;
 	zi_glyph_t *glyphs;
+	zi_index_t *index;    // codepoint lookup, NULL until zi_build_index()
+	uint8_t *slab;        // single allocation holding all glyph data, or NULL
 } zi_font_t;
 
+typedef struct {
+	char *font_name;      // description string from .zi header
+	uint8_t height;
+	uint32_t glyph_count;
+	uint8_t align8;       // charmap offsets are in units of 8 bytes
+	uint8_t mapped;       // base is a file mapping owned by zi_file_t
+	const uint8_t *cmap;  // charmap, 10 bytes per glyph
+	const uint8_t *base;  // mapped file
+	size_t size;
+} zi_file_t;
+
+typedef struct {
+	uint16_t c;            // unicode codepoint
+	uint8_t w;             // width
+	uint16_t len;          // encoded length, including mode byte
+	const uint8_t *data;   // encoded glyph stream (mode byte first)
+} zi_entry_t;
+
+typedef struct {
+	unsigned threads;     // decode threads, 0 or 1 decodes on calling thread
+	uint8_t packed;       // keep glyphs at native depth (ZI_BPP1/ZI_BPP4)
+} zi_load_opts_t;
+
+#define ZI_VISIBLE 19 // lowest 8-bit alpha that quantizes above 0
+
+#define ZI_LEVEL_FAST 1 // single pass, longest opcode at each step
+#define ZI_LEVEL_BEST 2 // optimal DP, smallest output (default)
+
+typedef struct {
+	uint32_t glyph_bytes;  // encoded glyph streams, before alignment
+	uint32_t file_bytes;   // total .zi size
+	uint32_t shared_glyphs;  // glyphs whose stream lies within another glyph's
+	uint32_t shared_bytes;   // stream bytes not written thanks to sharing
+	uint32_t pad_bytes;      // align8 padding after streams
+	uint32_t pad_saved;      // align8 padding avoided by nesting streams in longer ones
+	uint32_t cache_hits;     // glyphs taken from opts.cache
+	uint32_t cache_misses;   // glyphs encoded and added to opts.cache
+	uint32_t lossy_pixels;   // pixels moved off their nearest level by opts.max_err
+	uint8_t lossy_max_err;   // largest error of those pixels against the source
+	uint32_t best_bytes;     // file_bytes at ZI_LEVEL_BEST, when made at another level
+	uint32_t exact_bytes;    // file_bytes with max_err 0, when made lossy
+} zi_make_stats_t;
+
+typedef struct {
+	uint8_t level;            // encoder effort ZI_LEVEL_*, 0 for default
+	unsigned threads;         // encode threads, 0 or 1 encodes on calling thread
+	uint8_t keep_dups;        // write identical streams once per glyph instead of sharing
+	zi_cache_t *cache;        // encoded stream cache from zi_cache_open(), or NULL
+	zi_make_stats_t *stats;   // filled in if not NULL
+	uint8_t max_err;          // lossy: pixel error allowed to shorten streams, 0 for lossless
+} zi_make_opts_t;
+
+// Resumable row decoder state, no allocation
+typedef struct {
+	const uint8_t *data;  // stream payload (after mode byte)
+	uint32_t len, pos;
+	const void *ops;      // opcode table for stream mode
+	uint8_t width, height, row;
+	uint8_t zeros;        // pending transparent pixels
+	uint8_t first_due;    // first pixel of opcode still pending
+	uint8_t first;
+	uint8_t rest;         // pending pixels of value
+	uint8_t value;
+} zi_rows_t;
+
+// Span callback for non-blank runs: row y, start x, len pixels of value
+typedef void (*zi_span_fn)(void *ctx, uint8_t y, uint8_t x, uint8_t len, uint8_t value);
+
 zi_font_t * zi_load(const char *path);
+zi_font_t * zi_load_ex(const char *path, const zi_load_opts_t *opts);
+zi_font_t * zi_load_mem(const uint8_t *buf, size_t size, const zi_load_opts_t *opts);
 void zi_free(zi_font_t *font);
-void zi_make_utf8(const char *file_name, const zi_font_t *font);
+int zi_build_index(zi_font_t *font);
+int32_t zi_find_index(const zi_font_t *font, uint32_t cp);
+const zi_glyph_t * zi_find_glyph(const zi_font_t *font, uint32_t cp);
+int zi_glyph_width(const zi_font_t *font, uint32_t cp);
+size_t zi_glyph_size(const zi_glyph_t *g, uint8_t height);
+uint8_t zi_glyph_pixel(const zi_glyph_t *g, uint32_t x, uint32_t y);
+void zi_glyph_unpack(const zi_glyph_t *g, uint8_t height, uint8_t *out);
+zi_file_t * zi_open(const char *path);
+zi_file_t * zi_open_mem(const uint8_t *buf, size_t size);
+void zi_close(zi_file_t *zf);
+int zi_file_entry(const zi_file_t *zf, uint32_t index, zi_entry_t *e);
+int zi_file_decode(const zi_file_t *zf, uint32_t index, uint8_t *out);
+int zi_file_rows(const zi_file_t *zf, uint32_t index, zi_rows_t *rs);
+int zi_rows_begin(zi_rows_t *rs, const uint8_t *stream, uint32_t len, uint8_t width, uint8_t height);
+int zi_rows_next(zi_rows_t *rs, uint8_t *line);
+int zi_rows_next_spans(zi_rows_t *rs, zi_span_fn span, void *ctx);
+void zi_quantize3(const uint8_t *src, uint8_t *dst, uint32_t n);
+int zi_is_binary(const uint8_t *px, uint32_t n);
+int zi_bbox(const uint8_t *px, uint32_t w, uint32_t h, uint8_t min, uint32_t box[4]);
+int zi_bbox_stride(const uint8_t *px, uint32_t w, uint32_t h, uint32_t stride, uint8_t min, uint32_t box[4]);
+void zi_rgba_to_gray(const uint8_t *rgba, uint8_t *dst, uint32_t n);
+zi_encoder_ctx_t * zi_encoder_new(uint32_t max_pixels);
+void zi_encoder_free(zi_encoder_ctx_t *ec);
+void zi_encoder_set_max_err(zi_encoder_ctx_t *ec, uint8_t max_err);
+int zi_encode_glyph(zi_encoder_ctx_t *ec, const zi_glyph_t *g, uint8_t height, uint8_t level, const uint8_t **out, uint32_t *len);
+int zi_encode_view(zi_encoder_ctx_t *ec, const zi_glyph_view_t *v, uint8_t height, uint8_t level, const uint8_t **out, uint32_t *len);
+zi_cache_t * zi_cache_open(const char *path);
+int zi_cache_close(zi_cache_t *cache);
+int zi_make_utf8(const char *file_name, const zi_font_t *font);
+int zi_make_utf8_ex(const char *file_name, const zi_font_t *font, const zi_make_opts_t *opts);
+uint8_t * zi_make_to_buffer(const zi_font_t *font, const zi_make_opts_t *opts, size_t *size);
+int zi_make_utf8_views(const char *file_name, const char *font_name, uint8_t height, const zi_glyph_view_t *views, uint32_t count, const zi_make_opts_t *opts);
+void zi_print_stats(const zi_make_opts_t *opts);
+zi_writer_t * zi_writer_open(const char *file_name, const char *font_name, uint8_t height, const zi_make_opts_t *opts);
+int zi_writer_add_glyph(zi_writer_t *w, const zi_glyph_t *g);
+int zi_writer_close(zi_writer_t *w);
+int zi_patch(const char *in_path, const char *out_path, const zi_glyph_t *glyphs, uint32_t count, const zi_make_opts_t *opts);
+uint8_t * zi_load_tga_gray(const char *path, int *w, int *h);
+int zi_make_arg(int argc, char **argv, int *i, const char *flags, zi_make_opts_t *opts);
 	
\ No newline at end of file
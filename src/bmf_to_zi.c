@@ -6,14 +6,10 @@
 #include <stdbool.h>
 #include <string.h>
 #include <dirent.h>
-#include <math.h>
 #include <ctype.h>
 #include "upng.h"
 #include "zi_font.h"
 
-#define HI(w) (((w) >> 8) & 0xFF)
-#define LO(w) ((w) & 0xFF)
-
 // Reads a whole file and returns a pointer to the data chunk
 // Needs to be free()'d
 void *blob(char *filename, size_t *size) {
@@ -51,70 +47,132 @@ typedef struct __attribute__((packed)) {
 _Static_assert(sizeof(tga_t) == 18, "Data structure size incorrect, use mingw-w64");
 
 typedef struct {
-	uint16_t c; // following char
-	int8_t k; // kerning distance
+	uint16_t first; // preceding char
+	uint16_t c;     // following char
+	int8_t k;       // kerning distance
 } kern_t;
 
-#define MAX_GLYPHS 1000
-#define MAX_KERN 64
-
 typedef struct {
 	uint16_t c;         // character
 	uint8_t w, h;       // size of character
 	int8_t x, y;        // draw at offset
 	uint8_t a;          // advance
-	uint8_t *data;      // pixel data
-	uint16_t data_size; // size of data (currently w*h, prepared for compression)
-	uint8_t kern_count; // number of kerning points
-	kern_t kern[MAX_KERN];
+	const uint8_t *data; // top-left pixel in atlas page
+	uint32_t stride;     // atlas page width
+	uint32_t kern_first; // kerning pairs kern[kern_first..], sorted by c
+	uint32_t kern_count; // number of kerning pairs
 } glyph_t;
 
-glyph_t glyph[MAX_GLYPHS];
-uint16_t glyph_count;
+// Sized from the chars and kerning block lengths
+glyph_t *glyph;
+uint32_t glyph_count;
+kern_t *kern;
+uint32_t kern_count;
 
-const bool v_out = true;
-const bool g_out = false;
+// Open addressing hash of codepoint to glyph index + 1, 0 is empty
+static uint32_t *glyph_slot;
+static uint8_t slot_bits;
 
-uint8_t *sample_rect(uint8_t * data, uint16_t s, uint16_t x, uint16_t y, uint8_t w, uint8_t h, uint16_t * out_size) {
-	*out_size = w * h;
-	uint8_t * out = malloc(w * h);
-	for(uint16_t yy = 0; yy < h; yy++) {
-		for(uint16_t xx = 0; xx < w; xx++) {
-			uint8_t pixel;
-			pixel = data[(y + yy) * s + (x + xx)];
-			out[yy * w + xx] = pixel;
-		}
+static uint32_t slot_hash(uint16_t c) {
+	return ((uint32_t)c * 2654435761u) >> (32 - slot_bits);
+}
+
+// Build once all glyphs are in, first glyph with a codepoint wins
+static int index_glyphs(void) {
+	free(glyph_slot);
+	slot_bits = 4;
+	while((1u << slot_bits) < glyph_count * 2) slot_bits++;
+	uint32_t mask = (1u << slot_bits) - 1;
+	glyph_slot = calloc(mask + 1, sizeof(uint32_t));
+	if(!glyph_slot) return -1;
+	for(uint32_t i = 0; i < glyph_count; i++) {
+		uint32_t h = slot_hash(glyph[i].c);
+		while(glyph_slot[h] && glyph[glyph_slot[h] - 1].c != glyph[i].c) h = (h + 1) & mask;
+		if(!glyph_slot[h]) glyph_slot[h] = i + 1;
 	}
-	return out;
+	return 0;
 }
 
-uint8_t *sample_rect_tga(tga_t * tga, uint16_t x, uint16_t y, uint8_t w, uint8_t h, uint16_t * out_size) {
-	*out_size = w * h;
-	uint8_t * out = malloc(w * h);
-	for(uint16_t yy = 0; yy < h; yy++) {
-		for(uint16_t xx = 0; xx < w; xx++) {
-			uint8_t pixel;
-			if(tga->imagedescriptor & 0x20) {
-				pixel = tga->data[(y + yy) * tga->width + (x + xx)];
-			} else {
-				pixel = tga->data[((tga->height - 1) - (y + yy)) * tga->width + (x + xx)];
-			}
-			if(g_out) printf("%c", (pixel > 128 ? 'X' : ' '));
-			out[yy * w + xx] = pixel;
-		}
-		if(g_out) printf("\n");
+// Glyph for codepoint or NULL
+static glyph_t *find_glyph(uint32_t c) {
+	if(!glyph_slot || c > 65535) return NULL;
+	uint32_t mask = (1u << slot_bits) - 1;
+	for(uint32_t h = slot_hash(c); glyph_slot[h]; h = (h + 1) & mask) {
+		if(glyph[glyph_slot[h] - 1].c == c) return &glyph[glyph_slot[h] - 1];
 	}
-	// TODO: RLE?
-	return out;
+	return NULL;
+}
+
+static int cmp_kern(const void *a, const void *b) {
+	const kern_t *x = a, *y = b;
+	if(x->first != y->first) return x->first < y->first ? -1 : 1;
+	if(x->c != y->c) return x->c < y->c ? -1 : 1;
+	return (x->k > y->k) - (x->k < y->k);
 }
 
-static char tga_fn[256];
+// Sort pairs by first and second char and hand each glyph its range
+static void sort_kerning(void) {
+	qsort(kern, kern_count, sizeof(kern_t), cmp_kern);
+	for(uint32_t i = 0; i < kern_count;) {
+		uint32_t n = i + 1;
+		while(n < kern_count && kern[n].first == kern[i].first) n++;
+		glyph_t *g = find_glyph(kern[i].first);
+		g->kern_first = i;
+		g->kern_count = n - i;
+		i = n;
+	}
+}
+
+const bool v_out = true;
+const bool g_out = false;
+
+// Atlas page as 8-bit grayscale, top row first
+typedef struct {
+	uint16_t width, height;
+	uint8_t *data;
+} page_t;
+
+// Load uncompressed 8-bit grayscale TGA, bottom-up files are flipped in place
+static int load_tga(char * fn, page_t * page) {
+	size_t tga_size = 0;
+	tga_t * tga = (tga_t *)blob(fn, &tga_size);
+	if(!tga || tga_size < sizeof(tga_t)) {
+		printf("Input files not accepted\n");
+		return 1;
+	}
+	if(tga->bitsperpixel != 8) {
+		printf("Only 8-bit TGA supported (%u)\n", tga->bitsperpixel);
+		return 1;
+	}
+	if(tga->datatypecode != 3) {
+		printf("Only uncompressed grayscale TGA supported\n");
+		return 1;
+	}
+	size_t n = (size_t)tga->width * tga->height;
+	if(tga_size < sizeof(tga_t) + tga->idlength + n) {
+		printf("TGA file truncated\n");
+		return 1;
+	}
+	page->width = tga->width;
+	page->height = tga->height;
+	page->data = tga->data + tga->idlength;
+	if(!(tga->imagedescriptor & 0x20)) {
+		uint8_t *tmp = malloc(page->width);
+		for(uint16_t y = 0; y < page->height / 2; y++) {
+			uint8_t *a = page->data + (size_t)y * page->width;
+			uint8_t *b = page->data + (size_t)(page->height - 1 - y) * page->width;
+			memcpy(tmp, a, page->width);
+			memcpy(a, b, page->width);
+			memcpy(b, tmp, page->width);
+		}
+		free(tmp);
+	}
+	return 0;
+}
 
-// Convert PNG to TGA
-int png_to_tga(char * fn) {
-	FILE* fh;
+// Decode 32-bit RGBA PNG straight to grayscale
+static int load_png(char * fn, page_t * page) {
 	upng_t* upng;
-	unsigned width, height, depth;
 	
 	upng = upng_new_from_file(fn);
 	if (upng_get_error(upng) != UPNG_EOK) {
@@ -131,45 +189,24 @@ int png_to_tga(char * fn) {
 		printf("Unable to decode PNG (%d)\n", upng_get_error(upng));
 		return 4;
 	}
-
-	width = upng_get_width(upng);
-	height = upng_get_height(upng);
-	depth = upng_get_bpp(upng) / 8;
-
 	if(upng_get_format(upng) != UPNG_RGBA8) {
 		printf("Only 32-bit RGBA PNG supported\n");
 		return 5;
 	}
-		
-	// Make TGA file
-	uint8_t * gs = malloc(width * height);
-	if(!gs) {
+	if(upng_get_width(upng) > 65535 || upng_get_height(upng) > 65535) {
+		printf("PNG too large\n");
+		return 5;
+	}
+
+	page->width = upng_get_width(upng);
+	page->height = upng_get_height(upng);
+	page->data = malloc((size_t)page->width * page->height);
+	if(!page->data) {
 		printf("Out of memory\n");
 		return 1;
-	};
-	if(strlen(fn) >= sizeof(tga_fn) - 4) {
-		printf("Filename too long\n");
-		return 1;
-	};
-	strcat(fn, ".tga");
-	fh = fopen(fn, "wb");
-	fprintf(fh, "%c%c%c", 0, 0, 3);
-	fprintf(fh, "%c%c%c%c%c", 0, 0, 0, 0, 0);
-	fprintf(fh, "%c%c%c%c%c%c%c%c%c%c", 0, 0, 0, 0, LO(width), HI(width), LO(height), HI(height), 8, 0);
-	for (unsigned y = 0; y < height; ++y) {
-		for (unsigned x = 0; x < width; ++x) {
-			// Convert RGBA to 8-bit grayscale
-			uint8_t v = ((uint16_t)(upng_get_buffer(upng)[(height - y - 1) * width * depth + x * depth + (depth - 1 - 1)])
-			           + (uint16_t)(upng_get_buffer(upng)[(height - y - 1) * width * depth + x * depth + (depth - 2 - 1)])
-			           + (uint16_t)(upng_get_buffer(upng)[(height - y - 1) * width * depth + x * depth + (depth - 3 - 1)]))
-								/ 3;
-			v = roundf((float)v * (upng_get_buffer(upng)[(height - y - 1) * width * depth + x * depth + (depth - 0 - 1)]) / 255);
-			fputc(v, fh);
-		}
 	}
+	zi_rgba_to_gray(upng_get_buffer(upng), page->data, (uint32_t)page->width * page->height);
 
-  fclose(fh);
-	free(gs);
 	upng_free(upng);
 	
 	return 0;
@@ -186,30 +223,18 @@ bool ends_with_png(const uint8_t *p_block) {
             tolower(ext[3]) == 'g');
 }
 
-// Same as used in ZI
-static inline uint8_t q3(uint8_t v8) {
-  return (uint8_t)((v8 * 7 + 127) / 255);
-}
-
+// Crop glyph to its visible pixels, in place in the atlas
 void check_glyph(glyph_t * g) {
-	const uint8_t threshold = 0;
-	uint16_t x1 = 0, y1 = 0;
-	uint16_t x0 = g->w, y0 = g->h;
-	for(uint16_t y = 0; y < g->h; y++) {
-		for(uint16_t x = 0; x < g->w; x++) {
-			if(q3(g->data[y * g->w + x]) > threshold) {
-				if(x < x0) x0 = x;
-				if(x + 1 > x1) x1 = x + 1;
-				if(y < y0) y0 = y;
-				if(y + 1 > y1) y1 = y + 1;
-			}
+	uint32_t box[4];
+	zi_bbox_stride(g->data, g->w, g->h, g->stride, ZI_VISIBLE, box);
+	uint16_t x0 = box[0], y0 = box[1], x1 = box[2], y1 = box[3];
+	if(g_out) {
+		for(uint16_t y = 0; y < g->h; y++) {
+			for(uint16_t x = 0; x < g->w; x++) printf("%c", (g->data[y * g->stride + x] > 128 ? 'X' : ' '));
+			printf("\n");
 		}
 	}
-	if(x0 > x1) x0 = x1 = 0;
-	if(y0 > y1) y0 = y1 = 0;
-	uint8_t *data = sample_rect(g->data, g->w, x0, y0, x1 - x0, y1 - y0, &(g->data_size));
-	free(g->data);
-	g->data = data;
+	g->data += y0 * g->stride + x0;
 	g->w = x1 - x0;
 	g->h = y1 - y0;
 	g->x += x0;
@@ -222,13 +247,27 @@ void check_glyph(glyph_t * g) {
 int main(int argc, char *argv[]) {
 
 	if(argc < 2) {
-		printf("Usage: %s <font-without-fnt> (<pad-to-height>)\n", argv[0]);
+		printf("Usage: %s <font-without-fnt> (<pad-to-height>) (-1|-2) (-j<threads>) (-c <cache>) (-e<max_err>)\n", argv[0]);
+		printf("  -1 fast, -2 best encoding (default)\n");
+		printf("  -c reuse encoded glyphs from cache file, updated on exit\n");
+		printf("  -e lossy, let pixels move up to max_err (1..255) for smaller glyphs\n");
 		return 1;
 	}
 
 	int pad_height = 0;
-	if(argc >= 3) {
-			pad_height = atoi(argv[2]);
+	zi_make_stats_t stats = { 0 };
+	zi_make_opts_t opts = { .level = ZI_LEVEL_BEST, .threads = 1, .stats = &stats };
+	for(int i = 2; i < argc; i++) {
+		if(argv[i][0] == '-') {
+			int taken = zi_make_arg(argc, argv, &i, "jec", &opts);
+			if(taken < 0) return 1;
+			if(!taken) {
+				printf("Unknown option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			pad_height = atoi(argv[i]);
+		}
 	}
 
 	char fn[256];
@@ -245,7 +284,8 @@ int main(int argc, char *argv[]) {
 
 	uint8_t * p_font = font;
 	
-	tga_t ** tga = NULL;
+	page_t * page = NULL;
+	uint16_t page_count = 0;
 	
 	// Check magic
 	if(memcmp(p_font, "BMF", 3)) {
@@ -277,53 +317,40 @@ int main(int argc, char *argv[]) {
 			printf("%u %u\n", *(uint16_t *)&p_block[0], *(uint16_t *)&p_block[2]);
 			//base_line = *(uint16_t *)&p_block[2];
 			p_block += 8;
-			tga = malloc(*(uint16_t *)p_block * sizeof(tga_t *));
+			page_count = *(uint16_t *)p_block;
+			page = calloc(page_count, sizeof(page_t));
 			if(v_out) printf("OK\n");
 		} else if(block_type == 3) { // pages
 			uint8_t n = 0;
 			while(block_size) {
-				size_t tga_size = 0;
 				if(v_out) printf("Loading %s\n", p_block);
-				// Convert PNG (from modern tools) to TGA (what this was originally designed for)
-				if(strlen((const char *)p_block) >= sizeof(tga_fn)) {
-						printf("Filename too long\n");
-						return 1;
+				if(n >= page_count) {
+					printf("Too many pages\n");
+					return 1;
 				}
-				strcpy(tga_fn, (const char *)p_block);
-				bool temp_tga = false;
+				// PNG from modern tools, TGA is what this was originally designed for
 				if(ends_with_png(p_block)) {
-					temp_tga = true;
-					if(png_to_tga(tga_fn)) { // also changes tga_fn
-						return 1;
-					}
+					if(load_png((char *)p_block, &page[n])) return 1;
+				} else {
+					if(load_tga((char *)p_block, &page[n])) return 1;
 				}
-				tga[n] = (tga_t *)blob(tga_fn, &tga_size);
-				if(temp_tga) remove(tga_fn);
 				size_t skip = strlen((const char *)p_block) + 1;
 				block_size -= skip;
 				p_block += skip;
-				if(tga_size < sizeof(tga_t)) {
-					printf("Input files not accepted\n");
-					return 1;
-				}
-				if(tga[n]->bitsperpixel != 8) {
-					printf("Only 8-bit TGA supported (%u)\n", tga[n]->bitsperpixel);
-					return 1;
-				}
-				if(tga[n]->datatypecode != 3) {
-					printf("Only uncompressed grayscale TGA supported\n");
-					return 1;
-				}	
 				n++;
 			}
 		} else if(block_type == 4) { // chars
 			
-			while(block_size) {
+			glyph_t *grown = realloc(glyph, (glyph_count + block_size / 20) * sizeof(glyph_t));
+			if(!grown) {
+				printf("Out of memory\n");
+				return 1;
+			}
+			glyph = grown;
+			free(glyph_slot); // index is built again for kerning
+			glyph_slot = NULL;
 
-				if(glyph_count >= MAX_GLYPHS) {
-					printf("Too many glyphs\n");
-					return 1;
-				}
+			while(block_size >= 20) {
 
 				uint32_t id = *(uint32_t *)&p_block[0]; // unicode id
 				uint16_t src_x = *(uint16_t *)&p_block[4];
@@ -357,9 +384,16 @@ int main(int argc, char *argv[]) {
 				glyph[glyph_count].x = ox;
 				glyph[glyph_count].y = oy;
 				glyph[glyph_count].a = a;
+				glyph[glyph_count].kern_first = 0;
+				glyph[glyph_count].kern_count = 0;
 
-				uint8_t tga_id = p_block[18];
-				glyph[glyph_count].data = sample_rect_tga(tga[tga_id], src_x, src_y, w, h, &glyph[glyph_count].data_size);
+				uint8_t page_id = p_block[18];
+				if(page_id >= page_count || !page[page_id].data || src_x + w > page[page_id].width || src_y + h > page[page_id].height) {
+					printf("Glyph %u outside of page %u\n", id, page_id);
+					return 1;
+				}
+				glyph[glyph_count].data = page[page_id].data + (size_t)src_y * page[page_id].width + src_x;
+				glyph[glyph_count].stride = page[page_id].width;
 				
 				check_glyph(&glyph[glyph_count]);
 				
@@ -370,34 +404,40 @@ int main(int argc, char *argv[]) {
 			}
 			if(v_out) printf("\n");
 		} else if(block_type == 5) { // kerning pairs
-			while(block_size) {
+			kern_t *grown = realloc(kern, (kern_count + block_size / 10) * sizeof(kern_t));
+			if(!grown) {
+				printf("Out of memory\n");
+				return 1;
+			}
+			kern = grown;
+			if(!glyph_slot && index_glyphs()) {
+				printf("Out of memory\n");
+				return 1;
+			}
+
+			while(block_size >= 10) {
 				uint32_t first = *(uint32_t *)&p_block[0];
 				uint32_t id = *(uint32_t *)&p_block[4]; // second
-				int16_t kern = *(uint16_t *)&p_block[8];
+				int16_t k = *(uint16_t *)&p_block[8];
 				if(id < 1 || id > 65535) {
 					printf("Characted ID %u out of range\n", id);
 					return 1;
 				}
-				if(kern < -128 || kern > 127) {
-					printf("Kerning for %u:%u out of range (%d)\n", first, id, kern);
+				if(k < -128 || k > 127) {
+					printf("Kerning for %u:%u out of range (%d)\n", first, id, k);
 				}
-				for(uint16_t n = 0; n < glyph_count; n++) {
-					if(glyph[n].c == first) {
-						if(glyph[n].kern_count >= MAX_KERN) {
-							printf("Too many kerning pairs for glyph %u\n", n);
-							return 1;							
-						}
-						glyph[n].kern[glyph[n].kern_count].c = id;
-						glyph[n].kern[glyph[n].kern_count].k = kern;
-						glyph[n].kern_count++;
-						break;
-					}
+				if(find_glyph(first)) {
+					kern[kern_count].first = first;
+					kern[kern_count].c = id;
+					kern[kern_count].k = k;
+					kern_count++;
 				}
 				
 				p_block += 10;
 				block_size -= 10;
 			}
-			if(v_out) printf("Kerning processed\n");
+			sort_kerning();
+			if(v_out) printf("Kerning processed, %u pairs\n", kern_count);
 		}
 	}
 
@@ -408,17 +448,22 @@ int main(int argc, char *argv[]) {
 
  printf("Preparing ZI font output\n");
 
+	if(glyph_count == 0) {
+		printf("No glyphs in font\n");
+		return 1;
+	}
+
 	//Determine maximum height
 	int8_t min_h = glyph[glyph_count - 1].y;
-	for (uint16_t i = 0; i < glyph_count; i++) {
+	for (uint32_t i = 0; i < glyph_count; i++) {
 		if(glyph[i].h && glyph[i].y < min_h) min_h = glyph[i].y;
 	}
-	for (uint16_t i = 0; i < glyph_count; i++) {
+	for (uint32_t i = 0; i < glyph_count; i++) {
 		if(glyph[i].h) glyph[i].y -= min_h;
 		if(glyph[i].x < 0) glyph[i].x = 0;
 	}
 	uint8_t max_h = 0;
-	for (uint16_t i = 0; i < glyph_count; i++) {
+	for (uint32_t i = 0; i < glyph_count; i++) {
 		if(glyph[i].h) {
 			int bottom = glyph[i].y + glyph[i].h;
 			if(bottom > max_h) max_h = bottom;
@@ -430,54 +475,38 @@ int main(int argc, char *argv[]) {
 		printf("Padding height to: %u px\n", max_h);
 	}
 
-	// Make unified glyph array for ZI
-	zi_glyph_t *zi_glyphs = calloc(glyph_count, sizeof(glyph_t));
+	// Glyph views into the atlas pages, the encoder pads them to full cells
+	zi_glyph_view_t *views = calloc(glyph_count, sizeof(zi_glyph_view_t));
 
-	for (uint16_t i = 0; i < glyph_count; i++) {
-		
-
-			int full_w = glyph[i].x + glyph[i].w;   // include left offset
-			int full_h = max_h;
-			if(full_w < glyph[i].a) full_w = glyph[i].a;
-			
-			uint8_t *dst = calloc((size_t)full_w * full_h, 1); // cleared background
-			uint8_t *src = glyph[i].data;
+	for (uint32_t i = 0; i < glyph_count; i++) {
+		int full_w = glyph[i].x + glyph[i].w;   // include left offset
+		if(full_w < glyph[i].a) full_w = glyph[i].a;
 
-			// Copy glyph bitmap into correct X/Y position
-			
-			for(uint8_t y = 0; y < glyph[i].h; y++) {
-					uint8_t *drow = dst + (y + glyph[i].y) * full_w + glyph[i].x;
-					uint8_t *srow = src + y * glyph[i].w;
-					memcpy(drow, srow, glyph[i].w);
-			}
+		views[i] = (zi_glyph_view_t){
+			.c = glyph[i].c, .w = full_w,
+			.x = glyph[i].x, .y = glyph[i].h ? glyph[i].y : 0,
+			.cw = glyph[i].w, .ch = glyph[i].h,
+			.stride = glyph[i].stride, .data = glyph[i].data,
+		};
 
-			zi_glyphs[i].c = glyph[i].c;
-			zi_glyphs[i].w = full_w;
-			zi_glyphs[i].data = dst;
-
-			printf("Glyph U+%04X(%lc) w=%u h=%u\n", zi_glyphs[i].c, (wchar_t)zi_glyphs[i].c, zi_glyphs[i].w, glyph[i].y + glyph[i].h);
-
-			free(src); // release original bitmap
+		printf("Glyph U+%04X(%lc) w=%u h=%u\n", views[i].c, (wchar_t)views[i].c, views[i].w, glyph[i].y + glyph[i].h);
 	}
 
-	// Build font struct for ZI
-	zi_font_t *zi_font = calloc(1, sizeof(zi_font_t));
-
 	size_t name_len = strlen(argv[1]) + 7; // " utf-8" + null
-	zi_font->font_name = malloc(name_len);
-	snprintf(zi_font->font_name, name_len, "%sutf-8", argv[1]);
-
-	zi_font->height = max_h;
-	zi_font->glyph_count = glyph_count;
-	zi_font->glyphs = zi_glyphs;
+	char *font_name = malloc(name_len);
+	snprintf(font_name, name_len, "%sutf-8", argv[1]);
 
 	// Make .zi file
 	char out_file[256];
 	snprintf(out_file, sizeof(out_file), "%s.zi", argv[1]);
 	printf("Writing output file: %s\n", out_file);
-	zi_make_utf8(out_file, zi_font);
+	int made = zi_make_utf8_views(out_file, font_name, max_h, views, glyph_count, &opts);
+	if(made) printf("Failed to write %s\n", out_file);
+	else zi_print_stats(&opts);
 
-	zi_free(zi_font);
+	free(views);
+	free(font_name);
+	if(zi_cache_close(opts.cache) || made) return 1;
 
 	printf("ZI font successfully written.\n");
 	
@@ -0,0 +1,112 @@
+//  DS Prototyp 2025 D.W.Taylor [senseitg@gmail.com]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "zi_font.h"
+
+// codepoint from "<anything>_<hex>.tga" filenames
+static int parse_glyph_code(const char *filename, uint32_t *out_code) {
+  const char *base = strrchr(filename, '/');
+  if (!base) base = strrchr(filename, '\\');
+  base = base ? base + 1 : filename;
+
+  const char *p = strrchr(base, '_');
+  p = p ? p + 1 : base;
+
+  char hex[9] = {0};
+  int i = 0;
+  while (isxdigit((unsigned char)p[i]) && i < 8) {
+    hex[i] = p[i];
+    i++;
+  }
+
+  if (i == 0 || strcmp(p + i, ".tga"))
+    return 0;
+
+  *out_code = (uint32_t)strtoul(hex, NULL, 16);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s <input.zi> <output.zi> <glyph.tga>... [-1|-2] [-j<threads>] [-c <cache>]\n", argv[0]);
+    fprintf(stderr, "  glyph files are named <font>_<hex>.tga as written by parse\n");
+    fprintf(stderr, "  -1 fast, -2 best encoding (default)\n");
+    fprintf(stderr, "  -c reuse encoded glyphs from cache file, updated on exit\n");
+    return 1;
+  }
+
+  char *in_file = argv[1];
+  char *out_file = argv[2];
+
+  zi_file_t *zf = zi_open(in_file);
+  if (!zf) return 1;
+  uint8_t height = zf->height;
+  zi_close(zf);
+
+  zi_make_stats_t stats = {0};
+  zi_make_opts_t opts = { .level = ZI_LEVEL_BEST, .threads = 1, .stats = &stats };
+  zi_glyph_t *glyphs = calloc(argc, sizeof(zi_glyph_t));
+  uint32_t count = 0;
+  int ret = 1;
+  if (!glyphs) {
+    perror("calloc");
+    return 1;
+  }
+
+  for (int i = 3; i < argc; i++) {
+    int taken = zi_make_arg(argc, argv, &i, "jc", &opts);
+    if (taken < 0) goto done;
+    if (taken) {
+      continue;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      goto done;
+    } else {
+      uint32_t code;
+      if (!parse_glyph_code(argv[i], &code)) {
+        fprintf(stderr, "%s: no codepoint in file name\n", argv[i]);
+        goto done;
+      }
+      if (code > 0xFFFF) {
+        fprintf(stderr, "%s: codepoint U+%X outside BMP\n", argv[i], code);
+        goto done;
+      }
+      int w, h;
+      uint8_t *img = zi_load_tga_gray(argv[i], &w, &h);
+      if (!img) goto done;
+      if (h != height || w > 255) {
+        fprintf(stderr, "%s: expected height %u, got %dx%d\n", argv[i], height, w, h);
+        free(img);
+        goto done;
+      }
+      glyphs[count].c = code;
+      glyphs[count].w = (uint8_t)w;
+      glyphs[count].bpp = ZI_BPP8;
+      glyphs[count].data = img;
+      count++;
+    }
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "No glyphs given.\n");
+    goto done;
+  }
+
+  printf("Patching %u glyphs, %s -> %s ...\n", count, in_file, out_file);
+
+  int patched = zi_patch(in_file, out_file, glyphs, count, &opts);
+  if (patched < 0) goto done;
+  printf("Patched %d codepoints\n", patched);
+  zi_print_stats(&opts);
+  ret = 0;
+
+done:
+  for (uint32_t i = 0; i < count; ++i) free(glyphs[i].data);
+  free(glyphs);
+  if (zi_cache_close(opts.cache)) return 1;
+  return ret;
+}
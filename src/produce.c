@@ -3,57 +3,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <dirent.h>
 #include <ctype.h>
 #include "zi_font.h"
 
-// TGA loader (uncompressed grayscale)
-static uint8_t *load_tga_gray(const char *path, int *w, int *h) {
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    perror(path);
-    return NULL;
-  }
-
-  uint8_t hdr[18];
-  if (fread(hdr, 1, 18, f) != 18) {
-    fclose(f);
-    return NULL;
-  }
-
-  if (hdr[2] != 3) {  // type 3 = uncompressed grayscale
-    fprintf(stderr, "%s: not grayscale type 3 (found %u)\n", path, hdr[2]);
-    fclose(f);
-    return NULL;
-  }
-
-  *w = hdr[12] | (hdr[13] << 8);
-  *h = hdr[14] | (hdr[15] << 8);
-  uint8_t bpp = hdr[16];
-  if (bpp != 8) {
-    fprintf(stderr, "%s: expected 8bpp, got %u\n", path, bpp);
-    fclose(f);
-    return NULL;
-  }
-
-  size_t n = (size_t)(*w) * (*h);
-  uint8_t *buf = malloc(n);
-  if (!buf) {
-    fclose(f);
-    return NULL;
-  }
-
-  if (fread(buf, 1, n, f) != n) {
-    fprintf(stderr, "%s: truncated\n", path);
-    free(buf);
-    fclose(f);
-    return NULL;
-  }
-
-  fclose(f);
-  return buf;
-}
-
 // parse "<fontname>_<hex>.tga" filenames
 static int parse_glyph_filename(const char *font_name,
                                 const char *filename,
@@ -94,10 +48,24 @@ static int glyph_compare(const void *a, const void *b) {
 
 int main(int argc, char **argv) {
   if (argc < 4) {
-    fprintf(stderr, "Usage: %s <output.zi> <font_name> <height>\n", argv[0]);
+    fprintf(stderr, "Usage: %s <output.zi> <font_name> <height> [-1|-2] [-j<threads>] [-c <cache>] [-e<max_err>]\n", argv[0]);
+    fprintf(stderr, "  -1 fast, -2 best encoding (default)\n");
+    fprintf(stderr, "  -c reuse encoded glyphs from cache file, updated on exit\n");
+    fprintf(stderr, "  -e lossy, let pixels move up to max_err (1..255) for smaller glyphs\n");
     return 1;
   }
 
+  zi_make_stats_t stats = {0};
+  zi_make_opts_t opts = { .level = ZI_LEVEL_BEST, .threads = 1, .stats = &stats };
+  for (int i = 4; i < argc; i++) {
+    int taken = zi_make_arg(argc, argv, &i, "jec", &opts);
+    if (taken < 0) return 1;
+    if (!taken) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
   char *out_file = argv[1];
   char *font_name = argv[2];
   uint8_t height = (uint8_t)atoi(argv[3]);
@@ -119,7 +87,7 @@ int main(int argc, char **argv) {
     if (!parse_glyph_filename(font_name, de->d_name, &code)) continue;
 
     int w, h;
-    uint8_t *img = load_tga_gray(de->d_name, &w, &h);
+    uint8_t *img = zi_load_tga_gray(de->d_name, &w, &h);
     if (!img) continue;
     if (h != height) {
       fprintf(stderr, "%s: expected height %u, got %d (skipped)\n", de->d_name, height, h);
@@ -139,6 +107,7 @@ int main(int argc, char **argv) {
 
     glyphs[count].c = code;
     glyphs[count].w = (uint8_t)w;
+    glyphs[count].bpp = ZI_BPP8;
     glyphs[count].data = img;
     count++;
   }
@@ -162,10 +131,15 @@ int main(int argc, char **argv) {
 		.glyphs = glyphs
 	};
 
-	zi_make_utf8(out_file, &font);
+	int made = zi_make_utf8_ex(out_file, &font, &opts);
+  if (made)
+    fprintf(stderr, "Failed to write %s\n", out_file);
+  else
+    zi_print_stats(&opts);
 
   for (size_t i = 0; i < count; ++i) free(glyphs[i].data);
   free(glyphs);
 
+  if (zi_cache_close(opts.cache) || made) return 1;
   return 0;
 }
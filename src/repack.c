@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "zi_font.h"
 
 static long file_size(const char *path) {
@@ -15,11 +16,26 @@ static long file_size(const char *path) {
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input.zi> <output.zi>\n", argv[0]);
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <input.zi> <output.zi> [-1|-2] [-j<threads>] [-k] [-c <cache>] [-e<max_err>]\n", argv[0]);
+        fprintf(stderr, "  -1 fast, -2 best encoding (default)\n");
+        fprintf(stderr, "  -k keep duplicate glyph streams\n");
+        fprintf(stderr, "  -c reuse encoded glyphs from cache file, updated on exit\n");
+        fprintf(stderr, "  -e lossy, let pixels move up to max_err (1..255) for smaller glyphs\n");
         return 1;
     }
 
+    zi_make_stats_t stats = {0};
+    zi_make_opts_t opts = { .level = ZI_LEVEL_BEST, .threads = 1, .stats = &stats };
+    for (int i = 3; i < argc; i++) {
+        int taken = zi_make_arg(argc, argv, &i, "jekc", &opts);
+        if (taken < 0) return 1;
+        if (!taken) {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
     const char *in_file  = argv[1];
     const char *out_file = argv[2];
 
@@ -40,7 +56,12 @@ int main(int argc, char **argv) {
            font->font_name ? font->font_name : "(unnamed)",
            font->glyph_count, font->height);
 
-    zi_make_utf8(out_file, font);
+    if (zi_make_utf8_ex(out_file, font, &opts)) {
+        fprintf(stderr, "Failed to write output font: %s\n", out_file);
+        zi_free(font);
+        zi_cache_close(opts.cache);
+        return 1;
+    }
 
     long out_size = file_size(out_file);
     if (out_size < 0)
@@ -48,6 +69,7 @@ int main(int argc, char **argv) {
     else
         printf("Wrote: %s (%ld bytes)\n", out_file, out_size);
 
+    zi_print_stats(&opts);
     printf("---------------------------------------------\n");
     printf("Size change: %+ld bytes (%+.2f%%)\n",
            out_size - in_size,
@@ -55,5 +77,6 @@ int main(int argc, char **argv) {
     printf("---------------------------------------------\n");
 
     zi_free(font);
+    if (zi_cache_close(opts.cache)) return 1;
     return 0;
 }
\ No newline at end of file